@@ -1,13 +1,24 @@
+#include <linux/atomic.h>
 #include <linux/capability.h>
 #include <linux/compiler.h>
+#include <linux/crc32.h>
 #include <linux/fs.h>
 #include <linux/gfp.h>
 #include <linux/kernel.h>
+#include <linux/hash.h>
 #include <linux/list.h>
+#include <linux/moduleparam.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
 #include <linux/printk.h>
+#include <linux/rculist.h>
+#include <linux/rcupdate.h>
 #include <linux/slab.h>
+#include <linux/spinlock.h>
 #include <linux/types.h>
 #include <linux/version.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 14, 0)
 #include <linux/compiler_types.h>
 #endif
@@ -17,10 +28,11 @@
 #include "selinux/selinux.h"
 #include "kernel_compat.h"
 #include "allowlist.h"
+#include "grant_map.h"
 #include "manager.h"
 
 #define FILE_MAGIC 0x7f4b5355 // ' KSU', u32
-#define FILE_FORMAT_VERSION 3 // u32
+#define FILE_FORMAT_VERSION 4 // u32
 
 #define KSU_APP_PROFILE_PRESERVE_UID 9999 // NOBODY_UID
 #define KSU_DEFAULT_SELINUX_DOMAIN "u:r:su:s0"
@@ -31,38 +43,6 @@ static DEFINE_MUTEX(allowlist_mutex);
 static struct root_profile default_root_profile;
 static struct non_root_profile default_non_root_profile;
 
-static int allow_list_arr[PAGE_SIZE / sizeof(int)] __read_mostly __aligned(PAGE_SIZE);
-static int allow_list_pointer __read_mostly = 0;
-
-static void remove_uid_from_arr(uid_t uid)
-{
-	int *temp_arr;
-	int i, j;
-
-	if (allow_list_pointer == 0)
-		return;
-
-	temp_arr = kmalloc(sizeof(allow_list_arr), GFP_KERNEL);
-	if (temp_arr == NULL) {
-		pr_err("%s: unable to allocate memory\n", __func__);
-		return;
-	}
-
-	for (i = j = 0; i < allow_list_pointer; i++) {
-		if (allow_list_arr[i] == uid)
-			continue;
-		temp_arr[j++] = allow_list_arr[i];
-	}
-
-	allow_list_pointer = j;
-
-	for (; j < ARRAY_SIZE(allow_list_arr); j++)
-		temp_arr[j] = -1;
-
-	memcpy(&allow_list_arr, temp_arr, PAGE_SIZE);
-	kfree(temp_arr);
-}
-
 static void init_default_profiles()
 {
 	kernel_cap_t full_cap = CAP_FULL_SET;
@@ -80,33 +60,272 @@ static void init_default_profiles()
 	default_non_root_profile.umount_modules = true;
 }
 
+/*
+ * Every profile lives on two RCU lists: the global allow_list, which keeps
+ * insertion order for persistence and enumeration, and a uid-hashed bucket
+ * used by the lookups on the setuid / prctl paths.
+ * Readers only take rcu_read_lock(), writers serialize on allowlist_mutex
+ * and never modify a published node in place: it is replaced and freed
+ * after a grace period.
+ */
 struct perm_data {
 	struct list_head list;
+	struct list_head hash_list;
+	struct rcu_head rcu;
 	struct app_profile profile;
 };
 
-static struct list_head allow_list;
+static LIST_HEAD(allow_list);
+
+// bumped on every change of the list, lets enumerating clients detect concurrent modification
+static atomic_t allowlist_generation = ATOMIC_INIT(0);
+
+#define ALLOW_LIST_HASH_BITS 8
+static struct list_head allow_list_hash[1 << ALLOW_LIST_HASH_BITS];
+
+static inline struct list_head *uid_bucket(uid_t uid)
+{
+	return &allow_list_hash[hash_32(uid, ALLOW_LIST_HASH_BITS)];
+}
+
+// caller must hold allowlist_mutex
+static struct perm_data *find_profile_locked(uid_t uid, const char *key)
+{
+	struct perm_data *p;
+
+	list_for_each_entry (p, uid_bucket(uid), hash_list) {
+		// both uid and package must match, otherwise it will break multiple package with different user id
+		if (uid == p->profile.current_uid && !strcmp(key, p->profile.key))
+			return p;
+	}
+	return NULL;
+}
+
+/*
+ * per-uid decisions
+ *
+ * android uid = user id * PER_USER_RANGE + appid, so every android user gets
+ * a table with one decision byte per appid, allocated on first use and
+ * published with RCU. the setuid path answers "granted?" and "umount?" from
+ * a single byte instead of copying a whole app_profile out of the list.
+ * bytes are only written under allowlist_mutex, readers never see a torn
+ * state. uids which don't fit (isolated / sdk sandbox appids, huge user ids)
+ * are computed from the uid hash instead.
+ */
+#define PER_USER_RANGE 100000
+#define DECISION_APPID_MAX 20000 // LAST_APPLICATION_UID + 1
+#define DECISION_MAX_USERS 1024
+
+#define UID_HAS_PROFILE (1 << 0)
+#define UID_ALLOW_SU (1 << 1)
+#define UID_USE_DEFAULT (1 << 2)
+#define UID_UMOUNT (1 << 3)
+
+struct user_decisions {
+	u8 decision[DECISION_APPID_MAX];
+};
+
+static struct user_decisions __rcu *uid_decisions[DECISION_MAX_USERS] __read_mostly;
+
+static inline bool decision_in_range(uid_t uid)
+{
+	return uid / PER_USER_RANGE < DECISION_MAX_USERS &&
+	       uid % PER_USER_RANGE < DECISION_APPID_MAX;
+}
+
+static inline struct user_decisions *user_decisions_locked(uid_t uid)
+{
+	return rcu_dereference_protected(uid_decisions[uid / PER_USER_RANGE],
+					 lockdep_is_held(&allowlist_mutex));
+}
+
+// make sure the table of uid's user exists before we publish anything
+static bool decision_prepare_locked(uid_t uid)
+{
+	struct user_decisions *ud;
+
+	if (!decision_in_range(uid) || user_decisions_locked(uid))
+		return true;
+
+	ud = vzalloc(sizeof(*ud));
+	if (!ud)
+		return false;
+
+	rcu_assign_pointer(uid_decisions[uid / PER_USER_RANGE], ud);
+	return true;
+}
+
+/*
+ * the first profile of the uid decides about umount (like ksu_get_app_profile),
+ * any profile of the uid granted to su makes it granted. a granted first
+ * profile sets neither UID_USE_DEFAULT nor UID_UMOUNT, so it never umounts.
+ */
+static u8 compute_decision(uid_t uid)
+{
+	struct perm_data *p;
+	u8 decision = 0;
+
+	rcu_read_lock();
+	list_for_each_entry_rcu (p, uid_bucket(uid), hash_list) {
+		if (uid != p->profile.current_uid)
+			continue;
+		if (!(decision & UID_HAS_PROFILE)) {
+			decision |= UID_HAS_PROFILE;
+			if (!p->profile.allow_su) {
+				if (p->profile.nrp_config.use_default)
+					decision |= UID_USE_DEFAULT;
+				if (p->profile.nrp_config.profile.umount_modules)
+					decision |= UID_UMOUNT;
+			}
+		}
+		if (p->profile.allow_su)
+			decision |= UID_ALLOW_SU;
+	}
+	rcu_read_unlock();
 
-static uint8_t allow_list_bitmap[PAGE_SIZE] __read_mostly __aligned(PAGE_SIZE);
-#define BITMAP_UID_MAX ((sizeof(allow_list_bitmap) * BITS_PER_BYTE) - 1)
+	return decision;
+}
 
-#define KERNEL_SU_ALLOWLIST "/data/adb/ksu/.allowlist"
+static void decision_update_locked(uid_t uid)
+{
+	struct user_decisions *ud;
+	u8 decision;
 
-static struct work_struct ksu_save_work;
+	if (!decision_in_range(uid))
+		return;
+
+	ud = user_decisions_locked(uid);
+	if (!ud)
+		return;
+
+	decision = compute_decision(uid);
+	ud->decision[uid % PER_USER_RANGE] = decision;
+
+	ksu_grant_map_update(uid, decision & UID_ALLOW_SU,
+			     (decision & UID_HAS_PROFILE) &&
+				     !(decision & UID_USE_DEFAULT),
+			     decision & UID_UMOUNT);
+}
+
+static inline u8 uid_raw_decision(uid_t uid)
+{
+	struct user_decisions *ud;
+	u8 decision = 0;
+
+	if (unlikely(!decision_in_range(uid)))
+		return compute_decision(uid);
+
+	rcu_read_lock();
+	ud = rcu_dereference(uid_decisions[uid / PER_USER_RANGE]);
+	if (likely(ud))
+		decision = ud->decision[uid % PER_USER_RANGE];
+	rcu_read_unlock();
+
+	return decision;
+}
+
+#define KERNEL_SU_DIR "/data/adb/ksu"
+#define KERNEL_SU_ALLOWLIST_NAME ".allowlist"
+#define KERNEL_SU_ALLOWLIST_TMP_NAME ".allowlist.tmp"
+#define KERNEL_SU_ALLOWLIST KERNEL_SU_DIR "/" KERNEL_SU_ALLOWLIST_NAME
+#define KERNEL_SU_ALLOWLIST_TMP KERNEL_SU_DIR "/" KERNEL_SU_ALLOWLIST_TMP_NAME
+#define KERNEL_SU_JOURNAL KERNEL_SU_DIR "/.allowlist.journal"
+
+/*
+ * persistence
+ *
+ * .allowlist is a snapshot, mutations are appended to .allowlist.journal as
+ * set / delete records and replayed on top of the snapshot at load.
+ * once the journal grows past JOURNAL_COMPACT_RATIO times the snapshot, the
+ * whole list is written to a temp file and renamed over the snapshot, then
+ * the journal is truncated. replaying a record twice is harmless, so a crash
+ * between the rename and the truncate doesn't lose or duplicate anything.
+ */
+#define JOURNAL_MAGIC 0x7f4b534a // ' KSJ', u32
+#define JOURNAL_FORMAT_VERSION 2 // u32
+
+#define JOURNAL_OP_SET 1
+#define JOURNAL_OP_DELETE 2
+
+#define JOURNAL_COMPACT_MIN 64
+#define JOURNAL_COMPACT_RATIO 2
+
+struct journal_op {
+	struct list_head list;
+	u8 op;
+	struct app_profile profile;
+};
+
+// protected by allowlist_mutex
+static LIST_HEAD(pending_ops);
+// an op got lost or the journal is unusable, next save must compact
+static bool journal_broken = false;
+
+// only touched from the (ordered) save / load works
+static u32 snapshot_records = 0;
+static u32 journal_records = 0;
+
+/*
+ * mutations mark the list dirty and push the save back by save_debounce_ms,
+ * but never further than save_max_latency_ms after the first dirty mark.
+ */
+static struct delayed_work ksu_save_work;
 static struct work_struct ksu_load_work;
 
-static bool persistent_allow_list(void);
+static DEFINE_MUTEX(save_mutex); // one save at a time, also from exit
+static DEFINE_SPINLOCK(save_lock);
+static bool save_dirty = false;
+static unsigned long save_dirty_since;
+static unsigned int save_pending = 0;
+
+static unsigned int save_debounce_ms = 1000;
+module_param_named(allowlist_save_debounce_ms, save_debounce_ms, uint, 0644);
+static unsigned int save_max_latency_ms = 5000;
+module_param_named(allowlist_save_max_latency_ms, save_max_latency_ms, uint,
+		   0644);
+
+static unsigned int save_mutations = 0;
+module_param_named(allowlist_save_mutations, save_mutations, uint, 0444);
+static unsigned int save_writes = 0;
+module_param_named(allowlist_save_writes, save_writes, uint, 0444);
+static unsigned int save_last_merged = 0;
+module_param_named(allowlist_save_last_merged, save_last_merged, uint, 0444);
+
+static struct journal_op *journal_op_alloc(u8 type,
+					   const struct app_profile *profile)
+{
+	struct journal_op *op = kmalloc(sizeof(*op), GFP_KERNEL);
+	if (!op)
+		return NULL;
+
+	op->op = type;
+	memcpy(&op->profile, profile, sizeof(*profile));
+	return op;
+}
+
+// caller must hold allowlist_mutex
+static void journal_queue_locked(struct journal_op *op)
+{
+	if (!op) {
+		pr_err("journal op alloc failed, compact on next save\n");
+		journal_broken = true;
+		return;
+	}
+	list_add_tail(&op->list, &pending_ops);
+}
+
+static bool persistent_allow_list(unsigned int mutations);
 
 void ksu_show_allow_list(void)
 {
 	struct perm_data *p = NULL;
-	struct list_head *pos = NULL;
 	pr_info("ksu_show_allow_list\n");
-	list_for_each (pos, &allow_list) {
-		p = list_entry(pos, struct perm_data, list);
+	rcu_read_lock();
+	list_for_each_entry_rcu (p, &allow_list, list) {
 		pr_info("uid :%d, allow: %d\n", p->profile.current_uid,
 			p->profile.allow_su);
 	}
+	rcu_read_unlock();
 }
 
 #ifdef CONFIG_KSU_DEBUG
@@ -126,21 +345,19 @@ static void ksu_grant_root_to_shell()
 bool ksu_get_app_profile(struct app_profile *profile)
 {
 	struct perm_data *p = NULL;
-	struct list_head *pos = NULL;
 	bool found = false;
 
-	list_for_each (pos, &allow_list) {
-		p = list_entry(pos, struct perm_data, list);
-		bool uid_match = profile->current_uid == p->profile.current_uid;
-		if (uid_match) {
+	rcu_read_lock();
+	list_for_each_entry_rcu (p, uid_bucket(profile->current_uid), hash_list) {
+		if (profile->current_uid == p->profile.current_uid) {
 			// found it, override it with ours
 			memcpy(profile, &p->profile, sizeof(*profile));
 			found = true;
-			goto exit;
+			break;
 		}
 	}
+	rcu_read_unlock();
 
-exit:
 	return found;
 }
 
@@ -174,78 +391,51 @@ static bool profile_valid(struct app_profile *profile)
 	return true;
 }
 
-bool ksu_set_app_profile(struct app_profile *profile, bool persist)
+// caller must hold allowlist_mutex, p belongs to the list on success
+static bool insert_profile_locked(struct perm_data *p, bool verbose)
 {
-	struct perm_data *p = NULL;
-	struct list_head *pos = NULL;
-	bool result = false;
+	struct app_profile *profile = &p->profile;
+	struct perm_data *old = NULL;
 
-	if (!profile_valid(profile)) {
-		pr_err("Failed to set app profile: invalid profile!\n");
+	if (!decision_prepare_locked(profile->current_uid)) {
+		pr_err("ksu_set_app_profile alloc decision table failed\n");
 		return false;
 	}
 
-	list_for_each (pos, &allow_list) {
-		p = list_entry(pos, struct perm_data, list);
-		// both uid and package must match, otherwise it will break multiple package with different user id
-		if (profile->current_uid == p->profile.current_uid &&
-		    !strcmp(profile->key, p->profile.key)) {
-			// found it, just override it all!
-			memcpy(&p->profile, profile, sizeof(*profile));
-			result = true;
-			goto out;
-		}
-	}
-
-	// not found, alloc a new node!
-	p = (struct perm_data *)kmalloc(sizeof(struct perm_data), GFP_KERNEL);
-	if (!p) {
-		pr_err("ksu_set_app_profile alloc failed\n");
-		return false;
-	}
-
-	memcpy(&p->profile, profile, sizeof(*profile));
-	if (profile->allow_su) {
-		pr_info("set root profile, key: %s, uid: %d, gid: %d, context: %s\n",
-			profile->key, profile->current_uid,
-			profile->rp_config.profile.gid,
-			profile->rp_config.profile.selinux_domain);
-	} else {
-		pr_info("set app profile, key: %s, uid: %d, umount modules: %d\n",
-			profile->key, profile->current_uid,
-			profile->nrp_config.profile.umount_modules);
-	}
-	list_add_tail(&p->list, &allow_list);
-
-out:
-	if (profile->current_uid <= BITMAP_UID_MAX) {
-		if (profile->allow_su)
-			allow_list_bitmap[profile->current_uid / BITS_PER_BYTE] |= 1 << (profile->current_uid % BITS_PER_BYTE);
-		else
-			allow_list_bitmap[profile->current_uid / BITS_PER_BYTE] &= ~(1 << (profile->current_uid % BITS_PER_BYTE));
+	old = find_profile_locked(profile->current_uid, profile->key);
+	if (old) {
+		// found it, just override it all!
+		list_replace_rcu(&old->list, &p->list);
+		list_replace_rcu(&old->hash_list, &p->hash_list);
+		kfree_rcu(old, rcu);
 	} else {
-		if (profile->allow_su) {
-			/*
-			 * 1024 apps with uid higher than BITMAP_UID_MAX
-			 * registered to request superuser?
-			 */
-			if (allow_list_pointer >= ARRAY_SIZE(allow_list_arr)) {
-				pr_err("too many apps registered\n");
-				WARN_ON(1);
-				return false;
-			}
-			allow_list_arr[allow_list_pointer++] = profile->current_uid;
+		if (!verbose) {
+			// loading, don't flood the log
+		} else if (profile->allow_su) {
+			pr_info("set root profile, key: %s, uid: %d, gid: %d, context: %s\n",
+				profile->key, profile->current_uid,
+				profile->rp_config.profile.gid,
+				profile->rp_config.profile.selinux_domain);
 		} else {
-			remove_uid_from_arr(profile->current_uid);
+			pr_info("set app profile, key: %s, uid: %d, umount modules: %d\n",
+				profile->key, profile->current_uid,
+				profile->nrp_config.profile.umount_modules);
 		}
+		list_add_tail_rcu(&p->list, &allow_list);
+		list_add_tail_rcu(&p->hash_list, uid_bucket(profile->current_uid));
 	}
-	result = true;
+
+	decision_update_locked(profile->current_uid);
+	smp_wmb(); // the new decision before the generation, see allow_uid_cached()
+	atomic_inc(&allowlist_generation);
 
 	// check if the default profiles is changed, cache it to a single struct to accelerate access.
 	if (unlikely(!strcmp(profile->key, "$"))) {
 		// set default non root profile
 		memcpy(&default_non_root_profile, &profile->nrp_config.profile,
 		       sizeof(default_non_root_profile));
+		ksu_grant_map_set_default_umount(
+			default_non_root_profile.umount_modules);
 	}
 
 	if (unlikely(!strcmp(profile->key, "#"))) {
@@ -254,16 +444,94 @@ out:
 		       sizeof(default_root_profile));
 	}
 
+	return true;
+}
+
+static bool set_app_profile(struct app_profile *profile, bool persist)
+{
+	struct perm_data *p = NULL;
+	struct journal_op *op = NULL;
+
+	if (!profile_valid(profile)) {
+		pr_err("Failed to set app profile: invalid profile!\n");
+		return false;
+	}
+
+	// always alloc a new node, published nodes are never modified in place
+	p = (struct perm_data *)kmalloc(sizeof(struct perm_data), GFP_KERNEL);
+	if (!p) {
+		pr_err("ksu_set_app_profile alloc failed\n");
+		return false;
+	}
+	memcpy(&p->profile, profile, sizeof(*profile));
+
 	if (persist)
-		persistent_allow_list();
+		op = journal_op_alloc(JOURNAL_OP_SET, profile);
 
-	return result;
+	mutex_lock(&allowlist_mutex);
+
+	if (!insert_profile_locked(p, true)) {
+		mutex_unlock(&allowlist_mutex);
+		kfree(op);
+		kfree(p);
+		return false;
+	}
+
+	if (persist)
+		journal_queue_locked(op);
+
+	mutex_unlock(&allowlist_mutex);
+
+	return true;
 }
 
-bool __ksu_is_allow_uid(uid_t uid)
+bool ksu_set_app_profile(struct app_profile *profile, bool persist)
 {
-	int i;
+	if (!set_app_profile(profile, persist))
+		return false;
 
+	if (persist)
+		persistent_allow_list(1);
+
+	return true;
+}
+
+/*
+ * recent su verdicts per cpu, ALLOW_CACHE_SLOTS of them indexed by a hash of
+ * the uid, each one (generation & 0x7fffffff) << 33 | uid << 1 | allow.
+ * the sucompat hooks ask this for every faccessat / stat / execve / devpts
+ * access of the system, mostly about the same few uids taking turns, so a
+ * hit is one per cpu load and a compare. any change of the allowlist bumps
+ * the generation and every cached verdict misses. 0 is empty: root is never
+ * cached, its answer depends on the domain.
+ */
+#define ALLOW_CACHE_BITS 3
+#define ALLOW_CACHE_SLOTS (1 << ALLOW_CACHE_BITS)
+
+static DEFINE_PER_CPU(u64 [ALLOW_CACHE_SLOTS], allow_uid_cache);
+
+#define ALLOW_CACHE_KEY(uid, gen) \
+	(((u64)((gen) & 0x7fffffff) << 33) | ((u64)(u32)(uid) << 1))
+
+static inline bool allow_uid_cached(uid_t uid)
+{
+	u32 slot = hash_32(uid, ALLOW_CACHE_BITS);
+	u32 gen = atomic_read(&allowlist_generation);
+	u64 key = ALLOW_CACHE_KEY(uid, gen);
+	u64 cached = this_cpu_read(allow_uid_cache[slot]);
+	bool allow;
+
+	if (likely((cached & ~1ULL) == key))
+		return cached & 1;
+
+	smp_rmb(); // pairs with the writers, never cache an older decision under gen
+	allow = !!(uid_raw_decision(uid) & UID_ALLOW_SU);
+	this_cpu_write(allow_uid_cache[slot], key | allow);
+	return allow;
+}
+
+bool __ksu_is_allow_uid(uid_t uid)
+{
 	if (unlikely(uid == 0)) {
 		// already root, but only allow our domain.
 		return ksu_is_ksu_domain();
@@ -279,175 +547,787 @@ bool __ksu_is_allow_uid(uid_t uid)
 		return true;
 	}
 
-	if (likely(uid <= BITMAP_UID_MAX)) {
-		return !!(allow_list_bitmap[uid / BITS_PER_BYTE] & (1 << (uid % BITS_PER_BYTE)));
-	} else {
-		for (i = 0; i < allow_list_pointer; i++) {
-			if (allow_list_arr[i] == uid)
-				return true;
-		}
-	}
-
-	return false;
+	return allow_uid_cached(uid);
 }
 
-bool ksu_uid_should_umount(uid_t uid)
+u8 ksu_get_uid_decision(uid_t uid)
 {
-	struct app_profile profile = { .current_uid = uid };
+	u8 raw, decision = 0;
+
 	if (likely(ksu_is_manager_uid_valid()) && unlikely(ksu_get_manager_uid() == uid)) {
-		// we should not umount on manager!
-		return false;
+		// manager is always allowed, and we should not umount on manager!
+		return KSU_UID_ALLOW_SU | KSU_UID_IS_MANAGER;
 	}
-	bool found = ksu_get_app_profile(&profile);
-	if (!found) {
-		// no app profile found, it must be non root app
-		return default_non_root_profile.umount_modules;
+
+	raw = uid_raw_decision(uid);
+
+	if (unlikely(uid == 0)) {
+		// already root, but only allow our domain.
+		if (ksu_is_ksu_domain())
+			decision |= KSU_UID_ALLOW_SU;
+	} else if (!forbid_system_uid(uid) && (raw & UID_ALLOW_SU)) {
+		decision |= KSU_UID_ALLOW_SU;
 	}
-	if (profile.allow_su) {
-		// if found and it is granted to su, we shouldn't umount for it
-		return false;
-	} else {
-		// found an app profile
-		if (profile.nrp_config.use_default) {
-			return default_non_root_profile.umount_modules;
-		} else {
-			return profile.nrp_config.profile.umount_modules;
-		}
+
+	// umount only looks at the first profile, a granted one has no bits here
+	if (!(raw & UID_HAS_PROFILE)) {
+		// no app profile found, it must be non root app
+		if (default_non_root_profile.umount_modules)
+			decision |= KSU_UID_SHOULD_UMOUNT;
+	} else if (raw & UID_USE_DEFAULT) {
+		if (default_non_root_profile.umount_modules)
+			decision |= KSU_UID_SHOULD_UMOUNT;
+	} else if (raw & UID_UMOUNT) {
+		decision |= KSU_UID_SHOULD_UMOUNT;
 	}
+
+	return decision;
+}
+
+bool ksu_uid_should_umount(uid_t uid)
+{
+	return !!(ksu_get_uid_decision(uid) & KSU_UID_SHOULD_UMOUNT);
 }
 
-struct root_profile *ksu_get_root_profile(uid_t uid)
+// the node may be freed once we leave the read side, so copy it out
+void ksu_get_root_profile(uid_t uid, struct root_profile *profile)
 {
 	struct perm_data *p = NULL;
-	struct list_head *pos = NULL;
 
-	list_for_each (pos, &allow_list) {
-		p = list_entry(pos, struct perm_data, list);
+	rcu_read_lock();
+	list_for_each_entry_rcu (p, uid_bucket(uid), hash_list) {
 		if (uid == p->profile.current_uid && p->profile.allow_su) {
 			if (!p->profile.rp_config.use_default) {
-				return &p->profile.rp_config.profile;
+				memcpy(profile, &p->profile.rp_config.profile,
+				       sizeof(*profile));
+				rcu_read_unlock();
+				return;
 			}
 		}
 	}
+	rcu_read_unlock();
 
 	// use default profile
-	return &default_root_profile;
+	memcpy(profile, &default_root_profile, sizeof(*profile));
 }
 
-bool ksu_get_allow_list(int *array, int *length, bool allow)
+bool ksu_get_allow_list(int *array, int capacity, int *length, bool allow)
 {
 	struct perm_data *p = NULL;
-	struct list_head *pos = NULL;
+	bool complete = true;
 	int i = 0;
-	list_for_each (pos, &allow_list) {
-		p = list_entry(pos, struct perm_data, list);
+	rcu_read_lock();
+	list_for_each_entry_rcu (p, &allow_list, list) {
 		// pr_info("get_allow_list uid: %d allow: %d\n", p->uid, p->allow);
 		if (p->profile.allow_su == allow) {
+			if (i >= capacity) {
+				// a cut list looks complete to the caller, fail instead
+				complete = false;
+				break;
+			}
 			array[i++] = p->profile.current_uid;
 		}
 	}
+	rcu_read_unlock();
 	*length = i;
 
-	return true;
+	return complete;
 }
 
-static void do_save_allow_list(struct work_struct *work)
+/*
+ * fill at most capacity uids, skipping the first *cursor matches.
+ * the page is taken under allowlist_mutex, so it is consistent with the
+ * returned generation; clients restart when it changes between pages.
+ */
+bool ksu_get_allow_list_page(u32 *array, u32 capacity, u32 *cursor,
+			     u32 *length, bool allow, u32 *generation,
+			     bool *done)
 {
-	u32 magic = FILE_MAGIC;
-	u32 version = FILE_FORMAT_VERSION;
 	struct perm_data *p = NULL;
-	struct list_head *pos = NULL;
-	loff_t off = 0;
+	u32 skip = *cursor;
+	u32 i = 0;
+
+	*done = true;
+
+	mutex_lock(&allowlist_mutex);
+	list_for_each_entry (p, &allow_list, list) {
+		if (p->profile.allow_su != allow)
+			continue;
+		if (skip) {
+			skip--;
+			continue;
+		}
+		if (i >= capacity) {
+			*done = false;
+			break;
+		}
+		array[i++] = p->profile.current_uid;
+	}
+	*generation = atomic_read(&allowlist_generation);
+	mutex_unlock(&allowlist_mutex);
+
+	*cursor += i;
+	*length = i;
+
+	return true;
+}
+
+// caller must hold allowlist_mutex
+static void unlink_profile_locked(struct perm_data *p)
+{
+	list_del_rcu(&p->list);
+	list_del_rcu(&p->hash_list);
+	decision_update_locked(p->profile.current_uid);
+	smp_wmb();
+	atomic_inc(&allowlist_generation);
+	kfree_rcu(p, rcu);
+}
+
+// caller must hold allowlist_mutex
+static void remove_profile_locked(uid_t uid, const char *key)
+{
+	struct perm_data *p = find_profile_locked(uid, key);
+
+	if (p)
+		unlink_profile_locked(p);
+}
+
+/*
+ * v4 record
+ *
+ * a fixed header followed by the key and, for root profiles, the template
+ * name, uid, gid, the used groups only, capabilities, domain and namespaces.
+ * strings are u8 length prefixed and not terminated. crc covers everything
+ * after itself, so a torn or corrupted record is rejected instead of being
+ * loaded as garbage.
+ */
+struct allowlist_record {
+	u32 crc;
+	u16 len; // of the whole record, header included
+	u8 op; // JOURNAL_OP_*, 0 in the snapshot
+	u8 flags;
+	u32 version;
+	s32 current_uid;
+} __packed;
+
+#define RECORD_ALLOW_SU (1 << 0)
+#define RECORD_USE_DEFAULT (1 << 1)
+#define RECORD_UMOUNT (1 << 2)
+
+// the largest possible record is well below this
+#define RECORD_MAX_SIZE 1024
+
+static inline u8 *put_bytes(u8 *pos, const void *src, size_t len)
+{
+	memcpy(pos, src, len);
+	return pos + len;
+}
+
+static inline u8 *put_string(u8 *pos, const char *s, size_t size)
+{
+	u8 len = strnlen(s, size - 1);
+
+	*pos++ = len;
+	return put_bytes(pos, s, len);
+}
+
+// buf must have room for RECORD_MAX_SIZE bytes
+static size_t encode_record(u8 *buf, u8 op, const struct app_profile *profile)
+{
+	struct allowlist_record *rec = (struct allowlist_record *)buf;
+	u8 *pos = buf + sizeof(*rec);
+
+	rec->op = op;
+	rec->flags = 0;
+	rec->version = profile->version;
+	rec->current_uid = profile->current_uid;
+
+	pos = put_string(pos, profile->key, KSU_MAX_PACKAGE_NAME);
+
+	if (profile->allow_su) {
+		const struct root_profile *rp = &profile->rp_config.profile;
+		u8 groups = clamp_t(int32_t, rp->groups_count, 0, KSU_MAX_GROUPS);
+
+		rec->flags |= RECORD_ALLOW_SU;
+		if (profile->rp_config.use_default)
+			rec->flags |= RECORD_USE_DEFAULT;
+
+		pos = put_string(pos, profile->rp_config.template_name,
+				 KSU_MAX_PACKAGE_NAME);
+		pos = put_bytes(pos, &rp->uid, sizeof(rp->uid));
+		pos = put_bytes(pos, &rp->gid, sizeof(rp->gid));
+		*pos++ = groups;
+		pos = put_bytes(pos, rp->groups, groups * sizeof(rp->groups[0]));
+		pos = put_bytes(pos, &rp->capabilities, sizeof(rp->capabilities));
+		pos = put_string(pos, rp->selinux_domain, KSU_SELINUX_DOMAIN);
+		pos = put_bytes(pos, &rp->namespaces, sizeof(rp->namespaces));
+	} else {
+		if (profile->nrp_config.use_default)
+			rec->flags |= RECORD_USE_DEFAULT;
+		if (profile->nrp_config.profile.umount_modules)
+			rec->flags |= RECORD_UMOUNT;
+	}
+
+	rec->len = pos - buf;
+	rec->crc = crc32(0, buf + sizeof(rec->crc), rec->len - sizeof(rec->crc));
+
+	return rec->len;
+}
+
+struct record_reader {
+	const u8 *pos;
+	const u8 *end;
+	bool ok;
+};
+
+static void get_bytes(struct record_reader *r, void *dst, size_t len)
+{
+	if (!r->ok || (size_t)(r->end - r->pos) < len) {
+		r->ok = false;
+		return;
+	}
+	memcpy(dst, r->pos, len);
+	r->pos += len;
+}
+
+static void get_string(struct record_reader *r, char *dst, size_t size)
+{
+	u8 len = 0;
+
+	get_bytes(r, &len, sizeof(len));
+	if (len >= size)
+		r->ok = false;
+	get_bytes(r, dst, len);
+	if (r->ok)
+		dst[len] = '\0';
+}
+
+/*
+ * returns the size of the record at buf, 0 if buf ends in the middle of it
+ * and -EINVAL if it is corrupted.
+ */
+static ssize_t decode_record(const u8 *buf, size_t avail, u8 *op,
+			     struct app_profile *profile)
+{
+	struct allowlist_record rec;
+	struct record_reader r;
+
+	if (avail < sizeof(rec))
+		return 0;
+
+	memcpy(&rec, buf, sizeof(rec));
+	if (rec.len < sizeof(rec) || rec.len > RECORD_MAX_SIZE)
+		return -EINVAL;
+	if (avail < rec.len)
+		return 0;
+	if (rec.crc !=
+	    crc32(0, buf + sizeof(rec.crc), rec.len - sizeof(rec.crc)))
+		return -EINVAL;
+
+	memset(profile, 0, sizeof(*profile));
+	profile->version = rec.version;
+	profile->current_uid = rec.current_uid;
+	profile->allow_su = !!(rec.flags & RECORD_ALLOW_SU);
+
+	r.pos = buf + sizeof(rec);
+	r.end = buf + rec.len;
+	r.ok = true;
+
+	get_string(&r, profile->key, KSU_MAX_PACKAGE_NAME);
+
+	if (profile->allow_su) {
+		struct root_profile *rp = &profile->rp_config.profile;
+		u8 groups = 0;
+
+		profile->rp_config.use_default =
+			!!(rec.flags & RECORD_USE_DEFAULT);
+		get_string(&r, profile->rp_config.template_name,
+			   KSU_MAX_PACKAGE_NAME);
+		get_bytes(&r, &rp->uid, sizeof(rp->uid));
+		get_bytes(&r, &rp->gid, sizeof(rp->gid));
+		get_bytes(&r, &groups, sizeof(groups));
+		if (groups > KSU_MAX_GROUPS)
+			r.ok = false;
+		rp->groups_count = groups;
+		get_bytes(&r, rp->groups, groups * sizeof(rp->groups[0]));
+		get_bytes(&r, &rp->capabilities, sizeof(rp->capabilities));
+		get_string(&r, rp->selinux_domain, KSU_SELINUX_DOMAIN);
+		get_bytes(&r, &rp->namespaces, sizeof(rp->namespaces));
+	} else {
+		profile->nrp_config.use_default =
+			!!(rec.flags & RECORD_USE_DEFAULT);
+		profile->nrp_config.profile.umount_modules =
+			!!(rec.flags & RECORD_UMOUNT);
+	}
+
+	if (!r.ok || r.pos != r.end)
+		return -EINVAL;
+
+	*op = rec.op;
+	return rec.len;
+}
+
+// batches records into few large writes
+#define WRITE_BUF_SIZE (4 * PAGE_SIZE)
+
+struct record_writer {
+	struct file *fp;
+	loff_t off;
+	u8 *buf;
+	size_t len;
+	bool ok;
+};
 
-	struct file *fp =
-		ksu_filp_open_compat(KERNEL_SU_ALLOWLIST, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+static bool writer_init(struct record_writer *w, struct file *fp, loff_t off)
+{
+	w->fp = fp;
+	w->off = off;
+	w->len = 0;
+	w->buf = kmalloc(WRITE_BUF_SIZE, GFP_KERNEL);
+	w->ok = w->buf != NULL;
+	return w->ok;
+}
+
+static void writer_flush(struct record_writer *w)
+{
+	if (w->ok && w->len &&
+	    ksu_kernel_write_compat(w->fp, w->buf, w->len, &w->off) != w->len)
+		w->ok = false;
+	w->len = 0;
+}
+
+static void writer_put_u32(struct record_writer *w, u32 val)
+{
+	if (WRITE_BUF_SIZE - w->len < sizeof(val))
+		writer_flush(w);
+	memcpy(w->buf + w->len, &val, sizeof(val));
+	w->len += sizeof(val);
+}
+
+static void writer_put_record(struct record_writer *w, u8 op,
+			      const struct app_profile *profile)
+{
+	if (WRITE_BUF_SIZE - w->len < RECORD_MAX_SIZE)
+		writer_flush(w);
+	w->len += encode_record(w->buf + w->len, op, profile);
+}
+
+// flushes and releases the buffer, returns whether everything got written
+static bool writer_finish(struct record_writer *w)
+{
+	writer_flush(w);
+	kfree(w->buf);
+	return w->ok;
+}
+
+// write the whole list to the temp file and move it over the snapshot
+static bool compact_allow_list(void)
+{
+	struct perm_data *p = NULL;
+	struct record_writer w;
+	struct file *fp;
+	loff_t count_off = sizeof(u32) * 2;
+	u32 count = 0;
+	bool ok;
+	int err;
+
+	fp = ksu_filp_open_compat(KERNEL_SU_ALLOWLIST_TMP,
+				  O_WRONLY | O_CREAT | O_TRUNC, 0644);
 	if (IS_ERR(fp)) {
 		pr_err("save_allow_list create file failed: %ld\n", PTR_ERR(fp));
-		return;
+		return false;
 	}
 
-	// store magic and version
-	if (ksu_kernel_write_compat(fp, &magic, sizeof(magic), &off) !=
-	    sizeof(magic)) {
-		pr_err("save_allow_list write magic failed.\n");
-		goto exit;
+	if (!writer_init(&w, fp, 0)) {
+		filp_close(fp, 0);
+		return false;
 	}
 
-	if (ksu_kernel_write_compat(fp, &version, sizeof(version), &off) !=
-	    sizeof(version)) {
-		pr_err("save_allow_list write version failed.\n");
-		goto exit;
+	// header: magic, version, record count (filled in below)
+	writer_put_u32(&w, FILE_MAGIC);
+	writer_put_u32(&w, FILE_FORMAT_VERSION);
+	writer_put_u32(&w, 0);
+
+	mutex_lock(&allowlist_mutex);
+	list_for_each_entry (p, &allow_list, list) {
+		writer_put_record(&w, 0, &p->profile);
+		count++;
 	}
+	mutex_unlock(&allowlist_mutex);
 
-	list_for_each (pos, &allow_list) {
-		p = list_entry(pos, struct perm_data, list);
-		pr_info("save allow list, name: %s uid :%d, allow: %d\n",
-			p->profile.key, p->profile.current_uid,
-			p->profile.allow_su);
+	ok = writer_finish(&w) &&
+	     ksu_kernel_write_compat(fp, &count, sizeof(count), &count_off) ==
+		     sizeof(count);
+
+	// the data must hit the disk before the rename makes it visible
+	if (ok && vfs_fsync(fp, 0))
+		ok = false;
+	filp_close(fp, 0);
 
-		ksu_kernel_write_compat(fp, &p->profile, sizeof(p->profile),
-					&off);
+	if (!ok) {
+		pr_err("save_allow_list write snapshot failed\n");
+		return false;
 	}
 
-exit:
+	err = ksu_rename_compat(KERNEL_SU_DIR, KERNEL_SU_ALLOWLIST_TMP_NAME,
+				KERNEL_SU_ALLOWLIST_NAME);
+	if (err) {
+		pr_err("save_allow_list rename snapshot failed: %d\n", err);
+		return false;
+	}
+	snapshot_records = count;
+
+	// everything in the journal is part of the snapshot now
+	fp = ksu_filp_open_compat(KERNEL_SU_JOURNAL, O_WRONLY | O_CREAT | O_TRUNC,
+				  0644);
+	if (IS_ERR(fp)) {
+		pr_err("save_allow_list truncate journal failed: %ld\n",
+		       PTR_ERR(fp));
+		return false;
+	}
 	filp_close(fp, 0);
+	journal_records = 0;
+
+	pr_info("allowlist compacted, %u records\n", count);
+	return true;
 }
 
-static void do_load_allow_list(struct work_struct *work)
+static bool journal_append(struct list_head *ops, u32 count)
 {
-	loff_t off = 0;
-	ssize_t ret = 0;
-	struct file *fp = NULL;
-	u32 magic;
-	u32 version;
+	struct journal_op *op = NULL;
+	struct record_writer w;
+	struct file *fp;
+	loff_t off;
+	bool ok;
 
-#ifdef CONFIG_KSU_DEBUG
-	// always allow adb shell by default
-	ksu_grant_root_to_shell();
-#endif
+	fp = ksu_filp_open_compat(KERNEL_SU_JOURNAL, O_WRONLY | O_CREAT, 0644);
+	if (IS_ERR(fp)) {
+		pr_err("save_allow_list open journal failed: %ld\n", PTR_ERR(fp));
+		return false;
+	}
 
-	// load allowlist now!
-	fp = ksu_filp_open_compat(KERNEL_SU_ALLOWLIST, O_RDONLY, 0);
+	off = vfs_llseek(fp, 0, SEEK_END);
+	if (off > 0 && off < (loff_t)(sizeof(u32) * 2)) {
+		// half written header
+		filp_close(fp, 0);
+		return false;
+	}
+
+	if (!writer_init(&w, fp, off)) {
+		filp_close(fp, 0);
+		return false;
+	}
+
+	if (off == 0) {
+		writer_put_u32(&w, JOURNAL_MAGIC);
+		writer_put_u32(&w, JOURNAL_FORMAT_VERSION);
+	}
+
+	list_for_each_entry (op, ops, list)
+		writer_put_record(&w, op->op, &op->profile);
+
+	ok = writer_finish(&w);
+	filp_close(fp, 0);
+
+	if (!ok) {
+		pr_err("save_allow_list append journal failed\n");
+		return false;
+	}
+
+	journal_records += count;
+	return true;
+}
+
+static void do_save_allow_list(struct work_struct *work)
+{
+	LIST_HEAD(ops);
+	struct journal_op *op = NULL;
+	struct journal_op *n = NULL;
+	unsigned int merged;
+	u32 count = 0;
+	bool compact;
+
+	mutex_lock(&save_mutex);
+
+	spin_lock(&save_lock);
+	merged = save_pending;
+	save_pending = 0;
+	save_dirty = false;
+	spin_unlock(&save_lock);
+
+	if (merged) {
+		save_writes++;
+		save_last_merged = merged;
+	}
+
+	mutex_lock(&allowlist_mutex);
+	list_splice_init(&pending_ops, &ops);
+	compact = journal_broken;
+	journal_broken = false;
+	mutex_unlock(&allowlist_mutex);
+
+	list_for_each_entry (op, &ops, list)
+		count++;
+
+	if (!compact && !count)
+		goto out;
+
+	if (journal_records + count > JOURNAL_COMPACT_MIN &&
+	    journal_records + count > snapshot_records * JOURNAL_COMPACT_RATIO)
+		compact = true;
+
+	// a failed append may leave a torn record behind, only compaction can fix it
+	if (!compact && !journal_append(&ops, count))
+		compact = true;
+
+	if (compact && !compact_allow_list()) {
+		mutex_lock(&allowlist_mutex);
+		journal_broken = true;
+		mutex_unlock(&allowlist_mutex);
+	}
+
+	list_for_each_entry_safe (op, n, &ops, list)
+		kfree(op);
+out:
+	mutex_unlock(&save_mutex);
+}
+
+#define ALLOWLIST_MAX_FILE_SIZE (16 * 1024 * 1024)
+
+// one read of the whole file into a vmalloc buffer
+static u8 *read_whole_file(const char *path, size_t *size)
+{
+	struct file *fp;
+	loff_t end, off = 0;
+	ssize_t ret;
+	u8 *buf;
+
+	fp = ksu_filp_open_compat(path, O_RDONLY, 0);
 	if (IS_ERR(fp)) {
-		pr_err("load_allow_list open file failed: %ld\n", PTR_ERR(fp));
-		return;
+		pr_info("load_allow_list open %s failed: %ld\n", path,
+			PTR_ERR(fp));
+		return NULL;
 	}
 
-	// verify magic
-	if (ksu_kernel_read_compat(fp, &magic, sizeof(magic), &off) !=
-		    sizeof(magic) ||
-	    magic != FILE_MAGIC) {
-		pr_err("allowlist file invalid: %d!\n", magic);
+	end = vfs_llseek(fp, 0, SEEK_END);
+	if (end <= 0 || end > ALLOWLIST_MAX_FILE_SIZE) {
+		filp_close(fp, 0);
+		return NULL;
+	}
+
+	buf = vmalloc(end);
+	if (!buf) {
+		filp_close(fp, 0);
+		return NULL;
+	}
+
+	while (off < end) {
+		ret = ksu_kernel_read_compat(fp, buf + off, end - off, &off);
+		if (ret <= 0)
+			break;
+	}
+	filp_close(fp, 0);
+
+	*size = off;
+	return buf;
+}
+
+// caller must hold allowlist_mutex
+static bool apply_record_locked(u8 op, struct app_profile *profile)
+{
+	struct perm_data *p = NULL;
+
+	if (op == JOURNAL_OP_DELETE) {
+		remove_profile_locked(profile->current_uid, profile->key);
+		return true;
+	}
+
+	if (!profile_valid(profile))
+		return false;
+
+	p = (struct perm_data *)kmalloc(sizeof(struct perm_data), GFP_KERNEL);
+	if (!p)
+		return false;
+	memcpy(&p->profile, profile, sizeof(*profile));
+
+	if (!insert_profile_locked(p, false)) {
+		kfree(p);
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * apply the v4 records in buf, snapshot records have op 0.
+ * returns the number of records applied, *clean tells whether buf ended
+ * exactly at a record boundary.
+ */
+static u32 apply_records(const u8 *buf, size_t size, bool journal, bool *clean)
+{
+	struct app_profile profile;
+	size_t off = 0;
+	ssize_t ret;
+	u32 count = 0;
+	u8 op;
+
+	*clean = false;
+
+	mutex_lock(&allowlist_mutex);
+	while (off < size) {
+		ret = decode_record(buf + off, size - off, &op, &profile);
+		if (ret <= 0) {
+			pr_err("allowlist record %u %s\n", count,
+			       ret ? "corrupted" : "truncated");
+			goto out;
+		}
+
+		if (journal ? (op != JOURNAL_OP_SET && op != JOURNAL_OP_DELETE) :
+			      op != 0) {
+			pr_err("allowlist record %u unknown op: %u\n", count, op);
+			goto out;
+		}
+
+		apply_record_locked(journal ? op : JOURNAL_OP_SET, &profile);
+		off += ret;
+		count++;
+	}
+	*clean = true;
+out:
+	mutex_unlock(&allowlist_mutex);
+	return count;
+}
+
+// v3 snapshot: a plain struct app_profile per record
+static u32 apply_legacy_records(const u8 *buf, size_t size)
+{
+	struct app_profile profile;
+	size_t off = 0;
+	u32 count = 0;
+
+	mutex_lock(&allowlist_mutex);
+	for (; off + sizeof(profile) <= size; off += sizeof(profile)) {
+		memcpy(&profile, buf + off, sizeof(profile));
+		apply_record_locked(JOURNAL_OP_SET, &profile);
+		count++;
+	}
+	mutex_unlock(&allowlist_mutex);
+	return count;
+}
+
+static void load_snapshot(bool *migrate)
+{
+	size_t size = 0;
+	u32 magic, version, expected;
+	u32 count = 0;
+	bool clean;
+	u8 *buf;
+
+	buf = read_whole_file(KERNEL_SU_ALLOWLIST, &size);
+	if (!buf)
+		return;
+
+	if (size < sizeof(u32) * 2) {
+		pr_err("allowlist file too short: %zu\n", size);
 		goto exit;
 	}
 
-	if (ksu_kernel_read_compat(fp, &version, sizeof(version), &off) !=
-	    sizeof(version)) {
-		pr_err("allowlist read version: %d failed\n", version);
+	memcpy(&magic, buf, sizeof(magic));
+	memcpy(&version, buf + sizeof(u32), sizeof(version));
+	if (magic != FILE_MAGIC) {
+		pr_err("allowlist file invalid: %d!\n", magic);
 		goto exit;
 	}
 
 	pr_info("allowlist version: %d\n", version);
 
-	while (true) {
-		struct app_profile profile;
+	if (version >= 4) {
+		if (size < sizeof(u32) * 3)
+			goto exit;
+		memcpy(&expected, buf + sizeof(u32) * 2, sizeof(expected));
+		count = apply_records(buf + sizeof(u32) * 3,
+				      size - sizeof(u32) * 3, false, &clean);
+		if (!clean || count != expected) {
+			pr_err("allowlist loaded %u of %u records\n", count,
+			       expected);
+			// write a clean snapshot of what we could read
+			*migrate = true;
+		}
+	} else {
+		count = apply_legacy_records(buf + sizeof(u32) * 2,
+					     size - sizeof(u32) * 2);
+		// rewrite it in the current format
+		*migrate = true;
+	}
 
-		ret = ksu_kernel_read_compat(fp, &profile, sizeof(profile),
-					     &off);
+exit:
+	snapshot_records = count;
+	vfree(buf);
+}
 
-		if (ret <= 0) {
-			pr_info("load_allow_list read err: %zd\n", ret);
-			break;
-		}
+static void replay_journal(bool *migrate)
+{
+	size_t size = 0;
+	u32 magic, version;
+	u32 count = 0;
+	bool clean = false;
+	u8 *buf;
+
+	buf = read_whole_file(KERNEL_SU_JOURNAL, &size);
+	if (!buf) {
+		// no journal yet, nothing to replay
+		return;
+	}
+
+	if (size < sizeof(u32) * 2)
+		goto exit;
+
+	memcpy(&magic, buf, sizeof(magic));
+	memcpy(&version, buf + sizeof(u32), sizeof(version));
+	if (magic != JOURNAL_MAGIC) {
+		pr_err("allowlist journal invalid: %d!\n", magic);
+		goto exit;
+	}
 
-		pr_info("load_allow_uid, name: %s, uid: %d, allow: %d\n",
-			profile.key, profile.current_uid, profile.allow_su);
-		ksu_set_app_profile(&profile, false);
+	if (version != JOURNAL_FORMAT_VERSION) {
+		// clean stays false, the compaction starts a fresh journal
+		pr_err("allowlist journal version %u unsupported\n", version);
+		goto exit;
 	}
 
+	count = apply_records(buf + sizeof(u32) * 2, size - sizeof(u32) * 2,
+			      true, &clean);
+
 exit:
+	pr_info("allowlist journal replayed %u records\n", count);
+	journal_records = count;
+	// don't append behind garbage
+	if (!clean)
+		*migrate = true;
+	vfree(buf);
+}
+
+static void do_load_allow_list(struct work_struct *work)
+{
+	bool migrate = false;
+
+#ifdef CONFIG_KSU_DEBUG
+	// always allow adb shell by default
+	ksu_grant_root_to_shell();
+#endif
+
+	// load allowlist now!
+	load_snapshot(&migrate);
+	replay_journal(&migrate);
+
+	if (migrate) {
+		mutex_lock(&allowlist_mutex);
+		journal_broken = true;
+		mutex_unlock(&allowlist_mutex);
+		persistent_allow_list(1);
+	}
+
 	ksu_show_allow_list();
-	filp_close(fp, 0);
 }
 
 void ksu_prune_allowlist(bool (*is_uid_valid)(uid_t, char *, void *), void *data)
@@ -455,8 +1335,7 @@ void ksu_prune_allowlist(bool (*is_uid_valid)(uid_t, char *, void *), void *data
 	struct perm_data *np = NULL;
 	struct perm_data *n = NULL;
 
-	bool modified = false;
-	// TODO: use RCU!
+	unsigned int pruned = 0;
 	mutex_lock(&allowlist_mutex);
 	list_for_each_entry_safe (np, n, &allow_list, list) {
 		uid_t uid = np->profile.current_uid;
@@ -464,28 +1343,48 @@ void ksu_prune_allowlist(bool (*is_uid_valid)(uid_t, char *, void *), void *data
 		// we use this uid for special cases, don't prune it!
 		bool is_preserved_uid = uid == KSU_APP_PROFILE_PRESERVE_UID;
 		if (!is_preserved_uid && !is_uid_valid(uid, package, data)) {
-			modified = true;
+			pruned++;
 			pr_info("prune uid: %d, package: %s\n", uid, package);
-			list_del(&np->list);
-			if (likely(uid <= BITMAP_UID_MAX)) {
-				allow_list_bitmap[uid / BITS_PER_BYTE] &= ~(1 << (uid % BITS_PER_BYTE));
-			}
-			remove_uid_from_arr(uid);
-			smp_mb();
-			kfree(np);
+			journal_queue_locked(
+				journal_op_alloc(JOURNAL_OP_DELETE, &np->profile));
+			unlink_profile_locked(np);
 		}
 	}
 	mutex_unlock(&allowlist_mutex);
 
-	if (modified) {
-		persistent_allow_list();
+	if (pruned) {
+		persistent_allow_list(pruned);
 	}
 }
 
-// make sure allow list works cross boot
-static bool persistent_allow_list(void)
+// make sure allow list works cross boot, mutations: changes since the last call
+static bool persistent_allow_list(unsigned int mutations)
 {
-	return ksu_queue_work(&ksu_save_work);
+	unsigned long now = jiffies;
+	unsigned long deadline;
+
+	spin_lock(&save_lock);
+	if (!save_dirty) {
+		save_dirty = true;
+		save_dirty_since = now;
+	}
+	save_mutations += mutations;
+	save_pending += mutations;
+
+	deadline = now + msecs_to_jiffies(save_debounce_ms);
+	if (time_after(deadline,
+		       save_dirty_since + msecs_to_jiffies(save_max_latency_ms)))
+		deadline = save_dirty_since + msecs_to_jiffies(save_max_latency_ms);
+	spin_unlock(&save_lock);
+
+	return ksu_mod_delayed_work(&ksu_save_work,
+				    time_after(deadline, now) ? deadline - now : 0);
+}
+
+// write out everything pending right now
+void ksu_sync_allow_list(void)
+{
+	flush_delayed_work(&ksu_save_work);
 }
 
 bool ksu_load_allow_list(void)
@@ -497,32 +1396,49 @@ void ksu_allowlist_init(void)
 {
 	int i;
 
-	BUILD_BUG_ON(sizeof(allow_list_bitmap) != PAGE_SIZE);
-	BUILD_BUG_ON(sizeof(allow_list_arr) != PAGE_SIZE);
+	for (i = 0; i < ARRAY_SIZE(allow_list_hash); i++)
+		INIT_LIST_HEAD(&allow_list_hash[i]);
 
-	for (i = 0; i < ARRAY_SIZE(allow_list_arr); i++)
-		allow_list_arr[i] = -1;
-
-	INIT_LIST_HEAD(&allow_list);
-
-	INIT_WORK(&ksu_save_work, do_save_allow_list);
+	INIT_DELAYED_WORK(&ksu_save_work, do_save_allow_list);
 	INIT_WORK(&ksu_load_work, do_load_allow_list);
 
 	init_default_profiles();
+
+	ksu_grant_map_init();
 }
 
 void ksu_allowlist_exit(void)
 {
 	struct perm_data *np = NULL;
 	struct perm_data *n = NULL;
+	static struct user_decisions *tables[DECISION_MAX_USERS];
+	int i;
 
+	cancel_delayed_work_sync(&ksu_save_work);
 	do_save_allow_list(NULL);
 
 	// free allowlist
 	mutex_lock(&allowlist_mutex);
 	list_for_each_entry_safe (np, n, &allow_list, list) {
-		list_del(&np->list);
-		kfree(np);
+		list_del_rcu(&np->list);
+		list_del_rcu(&np->hash_list);
+		kfree_rcu(np, rcu);
+	}
+	for (i = 0; i < DECISION_MAX_USERS; i++) {
+		tables[i] = rcu_dereference_protected(
+			uid_decisions[i], lockdep_is_held(&allowlist_mutex));
+		RCU_INIT_POINTER(uid_decisions[i], NULL);
 	}
 	mutex_unlock(&allowlist_mutex);
+
+	// vfree may not be called from a rcu callback on older kernels
+	synchronize_rcu();
+	for (i = 0; i < DECISION_MAX_USERS; i++)
+		vfree(tables[i]);
+
+	ksu_grant_map_exit();
 }
+
+#ifdef CONFIG_KSU_KUNIT_TEST
+#include "allowlist_test.c"
+#endif
@@ -10,18 +10,35 @@ void ksu_allowlist_exit(void);
 
 bool ksu_load_allow_list(void);
 
+void ksu_sync_allow_list(void);
+
 void ksu_show_allow_list(void);
 
 bool __ksu_is_allow_uid(uid_t uid);
 #define ksu_is_allow_uid(uid) unlikely(__ksu_is_allow_uid(uid))
 
-bool ksu_get_allow_list(int *array, int *length, bool allow);
+// false if there are more than capacity uids, see ksu_get_allow_list_page
+bool ksu_get_allow_list(int *array, int capacity, int *length, bool allow);
+bool ksu_get_allow_list_page(u32 *array, u32 capacity, u32 *cursor,
+			     u32 *length, bool allow, u32 *generation,
+			     bool *done);
 
 void ksu_prune_allowlist(bool (*is_uid_exist)(uid_t, char *, void *), void *data);
 
 bool ksu_get_app_profile(struct app_profile *);
 bool ksu_set_app_profile(struct app_profile *, bool persist);
 
+/*
+ * compact per-uid decision, one lookup answers both questions of the setuid
+ * path. ALLOW_SU is set if any profile of the uid is granted, SHOULD_UMOUNT
+ * follows the first profile of the uid only (a granted first profile never
+ * umounts), same as ksu_get_app_profile() returns it.
+ */
+#define KSU_UID_ALLOW_SU (1 << 0)
+#define KSU_UID_SHOULD_UMOUNT (1 << 1)
+#define KSU_UID_IS_MANAGER (1 << 2)
+u8 ksu_get_uid_decision(uid_t uid);
+
 bool ksu_uid_should_umount(uid_t uid);
-struct root_profile *ksu_get_root_profile(uid_t uid);
+void ksu_get_root_profile(uid_t uid, struct root_profile *profile);
 #endif
@@ -0,0 +1,303 @@
+/*
+ * KUnit cases for allowlist.c, included at its end so the static helpers are
+ * reachable. profiles are set without persisting and removed again, the uids
+ * are picked so they don't clash with anything a booting device has.
+ */
+#include <kunit/test.h>
+#include <linux/ktime.h>
+
+// isolated appids, outside of the per-user decision tables
+#define TEST_UID_BASE 99900
+#define ALLOW_TEST_LOOPS 100000
+#define ALLOW_TEST_UIDS 6
+
+static void fill_test_profile(struct app_profile *profile, uid_t uid,
+			      const char *key, bool allow_su)
+{
+	memset(profile, 0, sizeof(*profile));
+	profile->version = KSU_APP_PROFILE_VER;
+	profile->current_uid = uid;
+	profile->allow_su = allow_su;
+	strscpy(profile->key, key, sizeof(profile->key));
+	if (allow_su) {
+		profile->rp_config.use_default = true;
+		strcpy(profile->rp_config.profile.selinux_domain,
+		       KSU_DEFAULT_SELINUX_DOMAIN);
+	} else {
+		profile->nrp_config.use_default = true;
+	}
+}
+
+static void set_test_profile(struct kunit *test, uid_t uid, const char *key,
+			     bool allow_su)
+{
+	struct app_profile profile;
+
+	fill_test_profile(&profile, uid, key, allow_su);
+	KUNIT_ASSERT_TRUE(test, ksu_set_app_profile(&profile, false));
+}
+
+static void drop_test_profile(uid_t uid, const char *key)
+{
+	mutex_lock(&allowlist_mutex);
+	remove_profile_locked(uid, key);
+	mutex_unlock(&allowlist_mutex);
+}
+
+static bool test_profile_exists(uid_t uid, const char *key)
+{
+	bool found;
+
+	mutex_lock(&allowlist_mutex);
+	found = find_profile_locked(uid, key) != NULL;
+	mutex_unlock(&allowlist_mutex);
+	return found;
+}
+
+static void allowlist_test_hash_lookup(struct kunit *test)
+{
+	struct app_profile profile = { .current_uid = TEST_UID_BASE };
+	int i;
+
+	// enough uids to put several of them into one bucket
+	for (i = 0; i < 64; i++)
+		set_test_profile(test, TEST_UID_BASE + i, "ksu.test.hash",
+				 i & 1);
+
+	for (i = 0; i < 64; i++) {
+		KUNIT_EXPECT_TRUE(test, test_profile_exists(TEST_UID_BASE + i,
+							    "ksu.test.hash"));
+		KUNIT_EXPECT_FALSE(test, test_profile_exists(TEST_UID_BASE + i,
+							     "ksu.test.other"));
+		KUNIT_EXPECT_EQ(test, __ksu_is_allow_uid(TEST_UID_BASE + i),
+				(bool)(i & 1));
+	}
+
+	KUNIT_EXPECT_TRUE(test, ksu_get_app_profile(&profile));
+	KUNIT_EXPECT_STREQ(test, profile.key, "ksu.test.hash");
+
+	for (i = 0; i < 64; i += 2)
+		drop_test_profile(TEST_UID_BASE + i, "ksu.test.hash");
+
+	for (i = 0; i < 64; i++)
+		KUNIT_EXPECT_EQ(test, test_profile_exists(TEST_UID_BASE + i,
+							  "ksu.test.hash"),
+				(bool)(i & 1));
+
+	for (i = 1; i < 64; i += 2)
+		drop_test_profile(TEST_UID_BASE + i, "ksu.test.hash");
+
+	profile.current_uid = TEST_UID_BASE + 1;
+	KUNIT_EXPECT_FALSE(test, ksu_get_app_profile(&profile));
+	KUNIT_EXPECT_FALSE(test, __ksu_is_allow_uid(TEST_UID_BASE + 1));
+}
+
+// one uid, several packages: a set replaces only the matching key
+static void allowlist_test_shared_uid(struct kunit *test)
+{
+	set_test_profile(test, TEST_UID_BASE, "ksu.test.a", false);
+	set_test_profile(test, TEST_UID_BASE, "ksu.test.b", false);
+	KUNIT_EXPECT_FALSE(test, __ksu_is_allow_uid(TEST_UID_BASE));
+
+	set_test_profile(test, TEST_UID_BASE, "ksu.test.b", true);
+	KUNIT_EXPECT_TRUE(test, test_profile_exists(TEST_UID_BASE, "ksu.test.a"));
+	KUNIT_EXPECT_TRUE(test, __ksu_is_allow_uid(TEST_UID_BASE));
+
+	drop_test_profile(TEST_UID_BASE, "ksu.test.b");
+	KUNIT_EXPECT_TRUE(test, test_profile_exists(TEST_UID_BASE, "ksu.test.a"));
+	KUNIT_EXPECT_FALSE(test, __ksu_is_allow_uid(TEST_UID_BASE));
+
+	drop_test_profile(TEST_UID_BASE, "ksu.test.a");
+	KUNIT_EXPECT_FALSE(test, test_profile_exists(TEST_UID_BASE, "ksu.test.a"));
+}
+
+static bool test_table_exists(uid_t uid)
+{
+	bool exists;
+
+	mutex_lock(&allowlist_mutex);
+	exists = user_decisions_locked(uid) != NULL;
+	mutex_unlock(&allowlist_mutex);
+	return exists;
+}
+
+// a user gets its table on the first profile, the byte follows the profile
+static void allowlist_test_user_table(struct kunit *test)
+{
+	uid_t uid = (DECISION_MAX_USERS - 1) * PER_USER_RANGE + 10123;
+
+	set_test_profile(test, uid, "ksu.test.table", true);
+	KUNIT_EXPECT_TRUE(test, test_table_exists(uid));
+	KUNIT_EXPECT_EQ(test, uid_raw_decision(uid),
+			(u8)(UID_HAS_PROFILE | UID_ALLOW_SU));
+	KUNIT_EXPECT_TRUE(test, __ksu_is_allow_uid(uid));
+
+	drop_test_profile(uid, "ksu.test.table");
+	KUNIT_EXPECT_EQ(test, uid_raw_decision(uid), (u8)0);
+	KUNIT_EXPECT_FALSE(test, __ksu_is_allow_uid(uid));
+}
+
+// appids past DECISION_APPID_MAX and users past the last table still work
+static void allowlist_test_out_of_table(struct kunit *test)
+{
+	static const uid_t uids[] = {
+		DECISION_APPID_MAX,
+		PER_USER_RANGE - 1,
+		DECISION_MAX_USERS * PER_USER_RANGE + 10123,
+		(DECISION_MAX_USERS + 7) * PER_USER_RANGE + DECISION_APPID_MAX,
+	};
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(uids); i++) {
+		KUNIT_EXPECT_FALSE(test, decision_in_range(uids[i]));
+
+		set_test_profile(test, uids[i], "ksu.test.range", true);
+		KUNIT_EXPECT_EQ(test, uid_raw_decision(uids[i]),
+				(u8)(UID_HAS_PROFILE | UID_ALLOW_SU));
+		KUNIT_EXPECT_TRUE(test, __ksu_is_allow_uid(uids[i]));
+
+		drop_test_profile(uids[i], "ksu.test.range");
+		KUNIT_EXPECT_EQ(test, uid_raw_decision(uids[i]), (u8)0);
+		KUNIT_EXPECT_FALSE(test, __ksu_is_allow_uid(uids[i]));
+	}
+}
+
+static void set_test_umount_profile(struct kunit *test, uid_t uid,
+				    const char *key, bool umount)
+{
+	struct app_profile profile;
+
+	fill_test_profile(&profile, uid, key, false);
+	profile.nrp_config.use_default = false;
+	profile.nrp_config.profile.umount_modules = umount;
+	KUNIT_ASSERT_TRUE(test, ksu_set_app_profile(&profile, false));
+}
+
+// any profile grants, only the first one decides about umount
+static void allowlist_test_shared_uid_decision(struct kunit *test)
+{
+	uid_t uid = TEST_UID_BASE;
+	u8 decision;
+
+	set_test_umount_profile(test, uid, "ksu.test.first", true);
+	set_test_profile(test, uid, "ksu.test.second", true);
+	decision = ksu_get_uid_decision(uid);
+	KUNIT_EXPECT_TRUE(test, decision & KSU_UID_ALLOW_SU);
+	KUNIT_EXPECT_TRUE(test, decision & KSU_UID_SHOULD_UMOUNT);
+	drop_test_profile(uid, "ksu.test.first");
+	drop_test_profile(uid, "ksu.test.second");
+
+	set_test_profile(test, uid, "ksu.test.first", true);
+	set_test_umount_profile(test, uid, "ksu.test.second", true);
+	decision = ksu_get_uid_decision(uid);
+	KUNIT_EXPECT_TRUE(test, decision & KSU_UID_ALLOW_SU);
+	KUNIT_EXPECT_FALSE(test, decision & KSU_UID_SHOULD_UMOUNT);
+	drop_test_profile(uid, "ksu.test.first");
+	drop_test_profile(uid, "ksu.test.second");
+
+	set_test_umount_profile(test, uid, "ksu.test.first", false);
+	decision = ksu_get_uid_decision(uid);
+	KUNIT_EXPECT_FALSE(test, decision & KSU_UID_ALLOW_SU);
+	KUNIT_EXPECT_FALSE(test, decision & KSU_UID_SHOULD_UMOUNT);
+	drop_test_profile(uid, "ksu.test.first");
+}
+
+static u32 test_cache_slot(uid_t uid)
+{
+	return hash_32(uid, ALLOW_CACHE_BITS);
+}
+
+// uids taking turns keep their own slots, a collision only costs a lookup
+static void allowlist_test_verdict_cache(struct kunit *test)
+{
+	uid_t allowed = TEST_UID_BASE, denied, other;
+	u64 allowed_slot, denied_slot;
+	bool verdicts[6];
+	u32 gen;
+
+	for (denied = allowed + 1;
+	     test_cache_slot(denied) == test_cache_slot(allowed); denied++)
+		;
+	for (other = denied + 1;
+	     test_cache_slot(other) != test_cache_slot(allowed); other++)
+		;
+
+	set_test_profile(test, allowed, "ksu.test.cache", true);
+	set_test_profile(test, denied, "ksu.test.cache", false);
+	set_test_profile(test, other, "ksu.test.cache", true);
+
+	// no expectations in here, a failing one may sleep
+	get_cpu();
+	verdicts[0] = allow_uid_cached(allowed);
+	verdicts[1] = allow_uid_cached(denied);
+	verdicts[2] = allow_uid_cached(allowed);
+	verdicts[3] = allow_uid_cached(denied);
+	gen = atomic_read(&allowlist_generation);
+	allowed_slot = this_cpu_read(allow_uid_cache[test_cache_slot(allowed)]);
+	denied_slot = this_cpu_read(allow_uid_cache[test_cache_slot(denied)]);
+	verdicts[4] = allow_uid_cached(other);
+	verdicts[5] = allow_uid_cached(allowed);
+	put_cpu();
+
+	KUNIT_EXPECT_TRUE(test, verdicts[0] && verdicts[2]);
+	KUNIT_EXPECT_FALSE(test, verdicts[1] || verdicts[3]);
+	KUNIT_EXPECT_EQ(test, allowed_slot, ALLOW_CACHE_KEY(allowed, gen) | 1);
+	KUNIT_EXPECT_EQ(test, denied_slot, ALLOW_CACHE_KEY(denied, gen));
+	KUNIT_EXPECT_TRUE(test, verdicts[4] && verdicts[5]);
+
+	// a change of the allowlist reaches every cached verdict
+	set_test_profile(test, allowed, "ksu.test.cache", false);
+	KUNIT_EXPECT_FALSE(test, __ksu_is_allow_uid(allowed));
+	drop_test_profile(other, "ksu.test.cache");
+	KUNIT_EXPECT_FALSE(test, __ksu_is_allow_uid(other));
+
+	drop_test_profile(allowed, "ksu.test.cache");
+	drop_test_profile(denied, "ksu.test.cache");
+}
+
+// per call cost for interleaved granted and denied uids, cached and not
+static void allowlist_test_verdict_cost(struct kunit *test)
+{
+	u64 start, cached_ns, lookup_ns;
+	int i, allowed = 0;
+
+	for (i = 0; i < ALLOW_TEST_UIDS; i++)
+		set_test_profile(test, TEST_UID_BASE + i, "ksu.test.cost", i & 1);
+
+	start = ktime_get_ns();
+	for (i = 0; i < ALLOW_TEST_LOOPS; i++)
+		allowed += __ksu_is_allow_uid(TEST_UID_BASE + i % ALLOW_TEST_UIDS);
+	cached_ns = ktime_get_ns() - start;
+
+	start = ktime_get_ns();
+	for (i = 0; i < ALLOW_TEST_LOOPS; i++)
+		allowed += !!(uid_raw_decision(TEST_UID_BASE + i % ALLOW_TEST_UIDS) &
+			      UID_ALLOW_SU);
+	lookup_ns = ktime_get_ns() - start;
+
+	KUNIT_EXPECT_EQ(test, allowed, ALLOW_TEST_LOOPS);
+	kunit_info(test, "%d uids: cached %llu ns/call, lookup %llu ns/call\n",
+		   ALLOW_TEST_UIDS, cached_ns / ALLOW_TEST_LOOPS,
+		   lookup_ns / ALLOW_TEST_LOOPS);
+
+	for (i = 0; i < ALLOW_TEST_UIDS; i++)
+		drop_test_profile(TEST_UID_BASE + i, "ksu.test.cost");
+}
+
+static struct kunit_case allowlist_test_cases[] = {
+	KUNIT_CASE(allowlist_test_hash_lookup),
+	KUNIT_CASE(allowlist_test_shared_uid),
+	KUNIT_CASE(allowlist_test_user_table),
+	KUNIT_CASE(allowlist_test_out_of_table),
+	KUNIT_CASE(allowlist_test_shared_uid_decision),
+	KUNIT_CASE(allowlist_test_verdict_cache),
+	KUNIT_CASE(allowlist_test_verdict_cost),
+	{}
+};
+
+static struct kunit_suite allowlist_test_suite = {
+	.name = "ksu_allowlist",
+	.test_cases = allowlist_test_cases,
+};
+
+kunit_test_suite(allowlist_test_suite);
@@ -1,9 +1,16 @@
 #include <linux/err.h>
 #include <linux/fs.h>
 #include <linux/gfp.h>
+#include <linux/bitmap.h>
+#include <linux/hash.h>
+#include <linux/jhash.h>
 #include <linux/kernel.h>
+#include <linux/mutex.h>
 #include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/uidgid.h>
 #include <linux/version.h>
+#include <linux/vmalloc.h>
 #ifdef CONFIG_KSU_DEBUG
 #include <linux/moduleparam.h>
 #endif
@@ -31,49 +38,282 @@ static struct sdesc *init_sdesc(struct crypto_shash *alg)
 	int size;
 
 	size = sizeof(struct shash_desc) + crypto_shash_descsize(alg);
-	sdesc = kmalloc(size, GFP_KERNEL);
+	sdesc = kzalloc(size, GFP_KERNEL);
 	if (!sdesc)
 		return ERR_PTR(-ENOMEM);
 	sdesc->shash.tfm = alg;
 	return sdesc;
 }
 
-static int calc_hash(struct crypto_shash *alg, const unsigned char *data,
-		     unsigned int datalen, unsigned char *digest)
+/*
+ * the sha256 transform and its descriptor are created on first use and kept
+ * until ksu_apk_sign_exit, so hashing a certificate costs only the hash.
+ */
+static DEFINE_MUTEX(sha256_mutex);
+static struct crypto_shash *sha256_tfm = NULL;
+static struct sdesc *sha256_sdesc = NULL;
+
+// caller must hold sha256_mutex
+static int sha256_prepare_locked()
 {
+	char *hash_alg_name = "sha256";
+	struct crypto_shash *alg;
 	struct sdesc *sdesc;
-	int ret;
+
+	if (sha256_sdesc)
+		return 0;
+
+	alg = crypto_alloc_shash(hash_alg_name, 0, 0);
+	if (IS_ERR(alg)) {
+		pr_info("can't alloc alg %s\n", hash_alg_name);
+		return PTR_ERR(alg);
+	}
 
 	sdesc = init_sdesc(alg);
 	if (IS_ERR(sdesc)) {
 		pr_info("can't alloc sdesc\n");
+		crypto_free_shash(alg);
 		return PTR_ERR(sdesc);
 	}
 
-	ret = crypto_shash_digest(&sdesc->shash, data, datalen, digest);
-	kfree(sdesc);
-	return ret;
+	sha256_tfm = alg;
+	sha256_sdesc = sdesc;
+	return 0;
 }
 
 static int ksu_sha256(const unsigned char *data, unsigned int datalen,
 		      unsigned char *digest)
 {
-	struct crypto_shash *alg;
-	char *hash_alg_name = "sha256";
 	int ret;
 
-	alg = crypto_alloc_shash(hash_alg_name, 0, 0);
-	if (IS_ERR(alg)) {
-		pr_info("can't alloc alg %s\n", hash_alg_name);
-		return PTR_ERR(alg);
-	}
-	ret = calc_hash(alg, data, datalen, digest);
-	crypto_free_shash(alg);
+	mutex_lock(&sha256_mutex);
+	ret = sha256_prepare_locked();
+	if (!ret)
+		ret = crypto_shash_digest(&sha256_sdesc->shash, data, datalen,
+					  digest);
+	mutex_unlock(&sha256_mutex);
 	return ret;
 }
 
-static bool check_block(struct file *fp, u32 *size4, loff_t *pos, u32 *offset,
-			unsigned expected_size, const char *expected_sha256)
+/*
+ * managers we trust, matched by size and sha256 of the v2 signer certificate.
+ * the builtin ones seed a hashed set at init, more can be listed in
+ * TRUSTED_CERTS_FILE, which is read again on every post-fs-data.
+ * the apk is parsed once and only a certificate of a trusted size gets hashed.
+ */
+#define CERT_MAX_LENGTH 1024
+#define TRUSTED_CERTS_FILE "/data/adb/ksu/.trusted_certs"
+#define TRUSTED_CERTS_MAX_FILE_SIZE (64 * 1024)
+#define TRUSTED_CERT_HASH_BITS 6
+
+struct builtin_cert {
+	u32 size;
+	const char *sha256;
+};
+
+static const struct builtin_cert builtin_certs[] = {
+	{ 0x363, "4359c171f32543394cbc23ef908c4bb94cad7c8087002ba164c8230948c21549" }, // dummy.keystore
+	{ EXPECTED_SIZE, EXPECTED_HASH }, // ksu official
+	{ 384, "7e0c6d7278a3bb8e364e0fcba95afaf3666cf5ff3c245a3b63c8833bd0445cc4" }, // 5ec1cff/KernelSU
+	{ 0x396, "f415f4ed9435427e1fdf7f1fccd4dbc07b3d6b8751e4dbcec6f19671f427870b" }, // rsuntk/KernelSU
+	{ 0x3e6, "79e590113c4c4c0c222978e413a5faa801666957b1212a328e46c00c69821bf7" }, // rifsxd/KernelSU-Next
+	{ 0x35c, "947ae944f3de4ed4c21a7e4f7953ecf351bfa2b36239da37a34111ad29993eef" }, // ShirkNeko/SukiSU-Ultra
+};
+
+struct trusted_cert {
+	struct list_head list;
+	u32 size;
+	u8 sha256[SHA256_DIGEST_SIZE];
+	bool builtin;
+};
+
+static DEFINE_MUTEX(trusted_mutex);
+static struct list_head trusted_certs[1 << TRUSTED_CERT_HASH_BITS];
+// bit n set: some trusted certificate is n bytes long
+static unsigned long trusted_sizes[BITS_TO_LONGS(CERT_MAX_LENGTH + 1)];
+// xor of every trusted cert's hash, changes with the set whatever the order
+static u32 trusted_fingerprint = 0;
+
+static inline u32 trusted_cert_hash(u32 size, const u8 *sha256)
+{
+	return jhash(sha256, SHA256_DIGEST_SIZE, size);
+}
+
+static inline struct list_head *trusted_cert_bucket(const u8 *sha256)
+{
+	u32 key;
+
+	memcpy(&key, sha256, sizeof(key));
+	return &trusted_certs[hash_32(key, TRUSTED_CERT_HASH_BITS)];
+}
+
+// caller must hold trusted_mutex
+static struct trusted_cert *find_trusted_cert_locked(u32 size, const u8 *sha256)
+{
+	struct trusted_cert *c;
+
+	list_for_each_entry (c, trusted_cert_bucket(sha256), list) {
+		if (c->size == size && !memcmp(c->sha256, sha256, SHA256_DIGEST_SIZE))
+			return c;
+	}
+	return NULL;
+}
+
+// caller must hold trusted_mutex
+static bool add_trusted_cert_locked(u32 size, const char *hex, bool builtin)
+{
+	u8 sha256[SHA256_DIGEST_SIZE];
+	struct trusted_cert *c;
+
+	if (!size || size > CERT_MAX_LENGTH ||
+	    strlen(hex) != SHA256_DIGEST_SIZE * 2 ||
+	    hex2bin(sha256, hex, SHA256_DIGEST_SIZE)) {
+		pr_err("invalid trusted cert: %u %s\n", size, hex);
+		return false;
+	}
+
+	if (find_trusted_cert_locked(size, sha256))
+		return true;
+
+	c = kmalloc(sizeof(*c), GFP_KERNEL);
+	if (!c)
+		return false;
+
+	c->size = size;
+	memcpy(c->sha256, sha256, SHA256_DIGEST_SIZE);
+	c->builtin = builtin;
+	list_add_tail(&c->list, trusted_cert_bucket(sha256));
+	set_bit(size, trusted_sizes);
+	trusted_fingerprint ^= trusted_cert_hash(size, sha256);
+	return true;
+}
+
+// caller must hold trusted_mutex
+static void drop_trusted_certs_locked(bool keep_builtin)
+{
+	struct trusted_cert *c, *n;
+	int i;
+
+	bitmap_zero(trusted_sizes, CERT_MAX_LENGTH + 1);
+	for (i = 0; i < ARRAY_SIZE(trusted_certs); i++) {
+		list_for_each_entry_safe (c, n, &trusted_certs[i], list) {
+			if (keep_builtin && c->builtin) {
+				set_bit(c->size, trusted_sizes);
+				continue;
+			}
+			list_del(&c->list);
+			trusted_fingerprint ^= trusted_cert_hash(c->size, c->sha256);
+			kfree(c);
+		}
+	}
+}
+
+static bool is_trusted_cert_size(u32 size)
+{
+	bool trusted;
+
+	if (size > CERT_MAX_LENGTH)
+		return false;
+
+	mutex_lock(&trusted_mutex);
+	trusted = test_bit(size, trusted_sizes);
+	mutex_unlock(&trusted_mutex);
+	return trusted;
+}
+
+static bool is_trusted_cert(u32 size, const u8 *sha256)
+{
+	bool trusted;
+
+	mutex_lock(&trusted_mutex);
+	trusted = find_trusted_cert_locked(size, sha256) != NULL;
+	mutex_unlock(&trusted_mutex);
+	return trusted;
+}
+
+u32 ksu_trusted_certs_fingerprint()
+{
+	u32 fingerprint;
+
+	mutex_lock(&trusted_mutex);
+	fingerprint = trusted_fingerprint;
+	mutex_unlock(&trusted_mutex);
+	return fingerprint;
+}
+
+/*
+ * one "<size> <sha256 hex>" per line, '#' starts a comment. the file must be
+ * owned by root and not writable by anyone else, entries of a previous load
+ * are replaced. a different set changes ksu_trusted_certs_fingerprint(), which
+ * makes the throne tracker forget its cached apk verdicts.
+ */
+void ksu_load_trusted_certs()
+{
+	struct inode *inode;
+	struct file *fp;
+	loff_t pos = 0;
+	ssize_t len;
+	char *buf, *cur, *line;
+	int count = 0;
+
+	fp = ksu_filp_open_compat(TRUSTED_CERTS_FILE, O_RDONLY, 0);
+	if (IS_ERR(fp))
+		return;
+
+	inode = file_inode(fp);
+	if (!uid_eq(inode->i_uid, GLOBAL_ROOT_UID) || (inode->i_mode & 0022)) {
+		pr_err(TRUSTED_CERTS_FILE " must be owned and only writable by root\n");
+		filp_close(fp, 0);
+		return;
+	}
+
+	buf = kmalloc(TRUSTED_CERTS_MAX_FILE_SIZE + 1, GFP_KERNEL);
+	if (!buf) {
+		filp_close(fp, 0);
+		return;
+	}
+
+	len = ksu_kernel_read_compat(fp, buf, TRUSTED_CERTS_MAX_FILE_SIZE, &pos);
+	filp_close(fp, 0);
+	if (len < 0) {
+		kfree(buf);
+		return;
+	}
+	buf[len] = '\0';
+
+	mutex_lock(&trusted_mutex);
+	drop_trusted_certs_locked(true);
+	cur = buf;
+	while ((line = strsep(&cur, "\n"))) {
+		char *hash = line;
+		char *size = strsep(&hash, " \t");
+		u32 cert_size;
+
+		if (!*line || *line == '#' || !size || !hash)
+			continue;
+
+		hash = strim(hash);
+		if (kstrtou32(size, 0, &cert_size) ||
+		    !add_trusted_cert_locked(cert_size, hash, false))
+			continue;
+		count++;
+	}
+	mutex_unlock(&trusted_mutex);
+
+	kfree(buf);
+	pr_info("loaded %d trusted certs from " TRUSTED_CERTS_FILE
+		", fingerprint: %08x\n", count, ksu_trusted_certs_fingerprint());
+}
+
+// the first certificate of the (only) v2 signer
+struct v2_signer {
+	u32 cert_size;
+	bool hashed; // only certificates of a trusted size are hashed
+	u8 sha256[SHA256_DIGEST_SIZE];
+};
+
+static bool read_signer_cert(struct file *fp, u32 *size4, loff_t *pos,
+			     u32 *offset, struct v2_signer *signer)
 {
 	ksu_kernel_read_compat(fp, size4, 0x4, pos); // signer-sequence length
 	ksu_kernel_read_compat(fp, size4, 0x4, pos); // signer length
@@ -90,91 +330,162 @@ static bool check_block(struct file *fp, u32 *size4, loff_t *pos, u32 *offset,
 	ksu_kernel_read_compat(fp, size4, 0x4, pos); // certificate length
 	*offset += 0x4 * 2;
 
-	if (*size4 == expected_size) {
-		*offset += *size4;
+	signer->cert_size = *size4;
+	signer->hashed = false;
+	if (!is_trusted_cert_size(*size4))
+		return true;
 
-#define CERT_MAX_LENGTH 1024
-		char cert[CERT_MAX_LENGTH];
-		if (*size4 > CERT_MAX_LENGTH) {
-			pr_info("cert length overlimit\n");
-			return false;
-		}
-		ksu_kernel_read_compat(fp, cert, *size4, pos);
-		unsigned char digest[SHA256_DIGEST_SIZE];
-		if (ksu_sha256(cert, *size4, digest) < 0 ) {
-			pr_info("sha256 error\n");
-			return false;
-		}
+	*offset += *size4;
 
-		char hash_str[SHA256_DIGEST_SIZE * 2 + 1];
-		hash_str[SHA256_DIGEST_SIZE * 2] = '\0';
+	char cert[CERT_MAX_LENGTH];
+	if (*size4 > CERT_MAX_LENGTH) {
+		pr_info("cert length overlimit\n");
+		return false;
+	}
+	ksu_kernel_read_compat(fp, cert, *size4, pos);
+	if (ksu_sha256(cert, *size4, signer->sha256) < 0 ) {
+		pr_info("sha256 error\n");
+		return false;
+	}
 
-		bin2hex(hash_str, digest, SHA256_DIGEST_SIZE);
-		pr_info("sha256: %s, expected: %s\n", hash_str,
-			expected_sha256);
-		if (strcmp(expected_sha256, hash_str) == 0) {
-			return true;
-		}
+	signer->hashed = true;
+	pr_info("sha256: %*phN, size: 0x%x\n", SHA256_DIGEST_SIZE,
+		signer->sha256, *size4);
+	return true;
+}
+
+// https://en.wikipedia.org/wiki/Zip_(file_format)#End_of_central_directory_record_(EOCD)
+#define EOCD_SIZE 22
+#define EOCD_MAX_COMMENT 0xffff
+
+struct zip_eocd {
+	loff_t pos;
+	u32 cd_size;
+	u32 cd_offset;
+};
+
+/*
+ * the EOCD sits at the end, followed only by a comment of up to 64K. read
+ * that whole tail once and scan it backwards for the signature whose comment
+ * length matches, same as ksud's get_apk_signature.
+ */
+static bool find_eocd_in_tail(const u8 *tail, size_t tail_len, loff_t size,
+			      struct zip_eocd *eocd)
+{
+	u32 i;
+
+	for (i = 0; i + EOCD_SIZE <= tail_len; i++) {
+		const u8 *p = tail + tail_len - EOCD_SIZE - i;
+		u16 comment_len;
+		u32 magic;
+
+		memcpy(&magic, p, 4);
+		memcpy(&comment_len, p + 20, 2);
+		if (magic != 0x06054b50 || comment_len != i) // 'PK\5\6'
+			continue;
+
+		eocd->pos = size - EOCD_SIZE - i;
+		memcpy(&eocd->cd_size, p + 12, 4);
+		memcpy(&eocd->cd_offset, p + 16, 4);
+		return true;
 	}
 	return false;
 }
 
-struct zip_entry_header {
-	uint32_t signature;
-	uint16_t version;
-	uint16_t flags;
-	uint16_t compression;
-	uint16_t mod_time;
-	uint16_t mod_date;
-	uint32_t crc32;
-	uint32_t compressed_size;
-	uint32_t uncompressed_size;
-	uint16_t file_name_length;
-	uint16_t extra_field_length;
-} __attribute__((packed));
-
-// This is a necessary but not sufficient condition, but it is enough for us
-static bool has_v1_signature_file(struct file *fp)
+static bool find_eocd(struct file *fp, struct zip_eocd *eocd)
+{
+	loff_t size = i_size_read(file_inode(fp));
+	size_t tail_len;
+	loff_t tail_pos;
+	bool found = false;
+	u8 *tail;
+
+	if (size < EOCD_SIZE)
+		return false;
+
+	tail_len = min_t(loff_t, size, EOCD_SIZE + EOCD_MAX_COMMENT);
+	tail_pos = size - tail_len;
+
+	tail = vmalloc(tail_len);
+	if (!tail)
+		return false;
+
+	if (ksu_kernel_read_compat(fp, tail, tail_len, &tail_pos) == tail_len)
+		found = find_eocd_in_tail(tail, tail_len, size, eocd);
+
+	vfree(tail);
+	return found;
+}
+
+#define CD_ENTRY_SIZE 46
+#define CD_MAX_SIZE (16 * 1024 * 1024)
+
+// the central directory entries are walked until META-INF/MANIFEST.MF shows up
+static bool cd_has_manifest(const u8 *cd, u32 cd_size)
 {
-	struct zip_entry_header header;
 	const char MANIFEST[] = "META-INF/MANIFEST.MF";
+	u32 off;
 
-	loff_t pos = 0;
+	for (off = 0; off + CD_ENTRY_SIZE <= cd_size;) {
+		const u8 *entry = cd + off;
+		u16 name_len, extra_len, comment_len;
+		u32 magic;
 
-	while (ksu_kernel_read_compat(fp, &header,
-				      sizeof(struct zip_entry_header), &pos) ==
-	       sizeof(struct zip_entry_header)) {
-		if (header.signature != 0x04034b50) {
-			// ZIP magic: 'PK'
-			return false;
-		}
-		// Read the entry file name
-		if (header.file_name_length == sizeof(MANIFEST) - 1) {
-			char fileName[sizeof(MANIFEST)];
-			ksu_kernel_read_compat(fp, fileName,
-					       header.file_name_length, &pos);
-			fileName[header.file_name_length] = '\0';
-
-			// Check if the entry matches META-INF/MANIFEST.MF
-			if (strncmp(MANIFEST, fileName, sizeof(MANIFEST) - 1) ==
-			    0) {
-				return true;
-			}
-		} else {
-			// Skip the entry file name
-			pos += header.file_name_length;
-		}
+		memcpy(&magic, entry, 4);
+		if (magic != 0x02014b50) // 'PK\1\2'
+			break;
 
-		// Skip to the next entry
-		pos += header.extra_field_length + header.compressed_size;
-	}
+		memcpy(&name_len, entry + 28, 2);
+		memcpy(&extra_len, entry + 30, 2);
+		memcpy(&comment_len, entry + 32, 2);
+		if (off + CD_ENTRY_SIZE + name_len > cd_size)
+			break;
 
+		// Check if the entry matches META-INF/MANIFEST.MF
+		if (name_len == sizeof(MANIFEST) - 1 &&
+		    !memcmp(entry + CD_ENTRY_SIZE, MANIFEST, name_len))
+			return true;
+
+		off += CD_ENTRY_SIZE + name_len + extra_len + comment_len;
+	}
 	return false;
 }
 
-static __always_inline bool check_v2_signature(char *path,
-					       unsigned expected_size,
-					       const char *expected_sha256)
+/*
+ * This is a necessary but not sufficient condition, but it is enough for us.
+ * names are looked up in the central directory, read in one go: the local
+ * headers don't carry sizes when data descriptors are used.
+ * an unreadable central directory counts as signed, the apk is rejected.
+ */
+static bool has_v1_signature_file(struct file *fp, const struct zip_eocd *eocd)
+{
+	loff_t pos = eocd->cd_offset;
+	bool found = true;
+	u8 *cd;
+
+	if (eocd->cd_size > CD_MAX_SIZE ||
+	    (loff_t)eocd->cd_offset + eocd->cd_size > eocd->pos) {
+		pr_err("bad central directory: %u@%u\n", eocd->cd_size,
+		       eocd->cd_offset);
+		return true;
+	}
+
+	cd = vmalloc(max_t(u32, eocd->cd_size, 1));
+	if (!cd)
+		return true;
+
+	if (ksu_kernel_read_compat(fp, cd, eocd->cd_size, &pos) == eocd->cd_size)
+		found = cd_has_manifest(cd, eocd->cd_size);
+
+	vfree(cd);
+	return found;
+}
+
+/*
+ * walk the apk once, 1 if it has exactly one v2 signer and nothing else, 0 if
+ * it doesn't and a negative errno if it couldn't be read right now.
+ */
+static int parse_v2_signature(char *path, struct v2_signer *signer)
 {
 	unsigned char buffer[0x11] = { 0 };
 	u32 size4;
@@ -187,10 +498,11 @@ static __always_inline bool check_v2_signature(char *path,
 	bool v3_signing_exist = false;
 	bool v3_1_signing_exist = false;
 
-	int i;
+	struct zip_eocd eocd;
 	struct path kpath;
-	if (kern_path(path, 0, &kpath))
-		return false;
+	int err = kern_path(path, 0, &kpath);
+	if (err)
+		return err;
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 5, 0) 
 	if (inode_is_locked(kpath.dentry->d_inode)) {
@@ -199,7 +511,7 @@ static __always_inline bool check_v2_signature(char *path,
 #endif
 		pr_info("%s: inode is locked for %s\n", __func__, path);
 		path_put(&kpath);
-		return false;
+		return -EBUSY;
 	}
 
 	path_put(&kpath);
@@ -207,33 +519,19 @@ static __always_inline bool check_v2_signature(char *path,
 	struct file *fp = ksu_filp_open_compat(path, O_RDONLY, 0);
 	if (IS_ERR(fp)) {
 		pr_err("open %s error.\n", path);
-		return false;
+		return PTR_ERR(fp);
 	}
 
 	// disable inotify for this file
 	fp->f_mode |= FMODE_NONOTIFY;
 
-	// https://en.wikipedia.org/wiki/Zip_(file_format)#End_of_central_directory_record_(EOCD)
-	for (i = 0;; ++i) {
-		unsigned short n;
-		pos = vfs_llseek(fp, -i - 2, SEEK_END);
-		ksu_kernel_read_compat(fp, &n, 2, &pos);
-		if (n == i) {
-			pos -= 22;
-			ksu_kernel_read_compat(fp, &size4, 4, &pos);
-			if ((size4 ^ 0xcafebabeu) == 0xccfbf1eeu) {
-				break;
-			}
-		}
-		if (i == 0xffff) {
-			pr_info("error: cannot find eocd\n");
-			goto clean;
-		}
+	if (!find_eocd(fp, &eocd)) {
+		pr_info("error: cannot find eocd\n");
+		goto clean;
 	}
 
-	pos += 12;
 	// offset
-	ksu_kernel_read_compat(fp, &size4, 0x4, &pos);
+	size4 = eocd.cd_offset;
 	pos = size4 - 0x18;
 
 	ksu_kernel_read_compat(fp, &size8, 0x8, &pos);
@@ -262,9 +560,8 @@ static __always_inline bool check_v2_signature(char *path,
 		offset = 4;
 		if (id == 0x7109871au) {
 			v2_signing_blocks++;
-			v2_signing_valid =
-				check_block(fp, &size4, &pos, &offset,
-					    expected_size, expected_sha256);
+			v2_signing_valid = read_signer_cert(fp, &size4, &pos,
+							    &offset, signer);
 		} else if (id == 0xf05368c0u) {
 			// http://aospxref.com/android-14.0.0_r2/xref/frameworks/base/core/java/android/util/apk/ApkSignatureSchemeV3Verifier.java#73
 			v3_signing_exist = true;
@@ -287,12 +584,14 @@ static __always_inline bool check_v2_signature(char *path,
 		v2_signing_valid = false;
 	}
 
-	if (v2_signing_valid) {
-		int has_v1_signing = has_v1_signature_file(fp);
+	// only a would-be manager is worth the central directory read
+	if (v2_signing_valid && signer->hashed &&
+	    is_trusted_cert(signer->cert_size, signer->sha256)) {
+		int has_v1_signing = has_v1_signature_file(fp, &eocd);
 		if (has_v1_signing) {
 			pr_err("Unexpected v1 signature scheme found!\n");
 			filp_close(fp, 0);
-			return false;
+			return 0;
 		}
 	}
 clean:
@@ -302,10 +601,10 @@ clean:
 #ifdef CONFIG_KSU_DEBUG
 		pr_err("Unexpected v3 signature scheme found!\n");
 #endif
-		return false;
+		return 0;
 	}
 
-	return v2_signing_valid;
+	return v2_signing_valid ? 1 : 0;
 }
 
 #ifdef CONFIG_KSU_DEBUG
@@ -332,29 +631,59 @@ module_param_cb(ksu_debug_manager_uid, &expected_size_ops,
 
 #endif
 
-bool ksu_is_manager_apk(char *path)
+enum ksu_apk_check ksu_check_manager_apk(char *path)
 {
-	int tries = 0;
-
-	while (tries++ < 10) {
-		if (!is_lock_held(path))
-			break;
+	unsigned int delay_us = 0, waited_us = 0;
+	struct v2_signer signer;
+	int ret;
 
-		pr_info("%s: waiting for %s\n", __func__, path);
-		msleep(100);
+	while (is_lock_held(path)) {
+		if (!ksu_wait_backoff(&delay_us, &waited_us)) {
+			pr_info("%s: timeout for %s\n", __func__, path);
+			return KSU_APK_UNKNOWN;
+		}
 	}
 
-	// let it go, if retry fails, check_v2_signature will fail to open it anyway
-	if (tries == 10) {
-		pr_info("%s: timeout for %s\n", __func__, path);
-		return false;
-	}
+	ret = parse_v2_signature(path, &signer);
+	if (ret < 0)
+		return KSU_APK_UNKNOWN;
+
+	if (ret && signer.hashed &&
+	    is_trusted_cert(signer.cert_size, signer.sha256))
+		return KSU_APK_MANAGER;
 
-	return (check_v2_signature(path, 0x363, "4359c171f32543394cbc23ef908c4bb94cad7c8087002ba164c8230948c21549") // dummy.keystore
-	|| check_v2_signature(path, EXPECTED_SIZE, EXPECTED_HASH)  // ksu official
-	|| check_v2_signature(path, 384, "7e0c6d7278a3bb8e364e0fcba95afaf3666cf5ff3c245a3b63c8833bd0445cc4")  // 5ec1cff/KernelSU
-	|| check_v2_signature(path, 0x396, "f415f4ed9435427e1fdf7f1fccd4dbc07b3d6b8751e4dbcec6f19671f427870b")  // rsuntk/KernelSU
-	|| check_v2_signature(path, 0x3e6, "79e590113c4c4c0c222978e413a5faa801666957b1212a328e46c00c69821bf7")  // rifsxd/KernelSU-Next
-	|| check_v2_signature(path, 0x35c, "947ae944f3de4ed4c21a7e4f7953ecf351bfa2b36239da37a34111ad29993eef")  // ShirkNeko/SukiSU-Ultra
-	);
+	return KSU_APK_NOT_MANAGER;
 }
+
+void ksu_apk_sign_init()
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(trusted_certs); i++)
+		INIT_LIST_HEAD(&trusted_certs[i]);
+
+	mutex_lock(&trusted_mutex);
+	for (i = 0; i < ARRAY_SIZE(builtin_certs); i++)
+		add_trusted_cert_locked(builtin_certs[i].size,
+					builtin_certs[i].sha256, true);
+	mutex_unlock(&trusted_mutex);
+}
+
+void ksu_apk_sign_exit()
+{
+	mutex_lock(&trusted_mutex);
+	drop_trusted_certs_locked(false);
+	mutex_unlock(&trusted_mutex);
+
+	mutex_lock(&sha256_mutex);
+	kfree(sha256_sdesc);
+	sha256_sdesc = NULL;
+	if (sha256_tfm)
+		crypto_free_shash(sha256_tfm);
+	sha256_tfm = NULL;
+	mutex_unlock(&sha256_mutex);
+}
+
+#ifdef CONFIG_KSU_KUNIT_TEST
+#include "apk_sign_test.c"
+#endif
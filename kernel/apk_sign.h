@@ -3,6 +3,23 @@
 
 #include <linux/types.h>
 
-bool ksu_is_manager_apk(char *path);
+enum ksu_apk_check {
+	KSU_APK_MANAGER,
+	KSU_APK_NOT_MANAGER, // signed, but not by a trusted cert
+	KSU_APK_UNKNOWN, // couldn't be checked right now, e.g. busy or gone
+};
+
+enum ksu_apk_check ksu_check_manager_apk(char *path);
+
+void ksu_apk_sign_init();
+
+// frees the trusted certs and the cached sha256 transform
+void ksu_apk_sign_exit();
+
+// (re)load the extra trusted manager certs under /data/adb/ksu
+void ksu_load_trusted_certs();
+
+// changes whenever the set of trusted certs does
+u32 ksu_trusted_certs_fingerprint();
 
 #endif
@@ -0,0 +1,370 @@
+/*
+ * KUnit cases for apk_sign.c, included at its end so the static helpers are
+ * reachable. the suites run at boot after ksu_apk_sign_init() and before
+ * post-fs-data, so only the builtin certs are trusted while they run, the
+ * ones they add are dropped again.
+ */
+#include <kunit/test.h>
+#include <linux/ktime.h>
+
+#define SHA256_TEST_LOOPS 1000
+#define TRUSTED_TEST_LOOPS 100000
+
+static const struct builtin_cert test_certs[] = {
+	{ 0x300, "00112233445566778899aabbccddeeff00112233445566778899aabbccddeeff" },
+	{ 0x300, "ffeeddccbbaa99887766554433221100ffeeddccbbaa99887766554433221100" },
+	{ 0x301, "0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef" },
+};
+
+static void test_cert_sha256(struct kunit *test, const char *hex, u8 *sha256)
+{
+	KUNIT_ASSERT_EQ(test, hex2bin(sha256, hex, SHA256_DIGEST_SIZE), 0);
+}
+
+static void add_test_certs(struct kunit *test)
+{
+	int i;
+
+	mutex_lock(&trusted_mutex);
+	for (i = 0; i < ARRAY_SIZE(test_certs); i++)
+		KUNIT_EXPECT_TRUE(test,
+				  add_trusted_cert_locked(test_certs[i].size,
+							  test_certs[i].sha256,
+							  false));
+	mutex_unlock(&trusted_mutex);
+}
+
+static void drop_test_certs(void)
+{
+	mutex_lock(&trusted_mutex);
+	drop_trusted_certs_locked(true);
+	mutex_unlock(&trusted_mutex);
+}
+
+// every cert of the set matches by its own size and hash, nothing else does
+static void apk_sign_test_multi_cert(struct kunit *test)
+{
+	u8 sha256[SHA256_DIGEST_SIZE];
+	int i;
+
+	add_test_certs(test);
+
+	for (i = 0; i < ARRAY_SIZE(test_certs); i++) {
+		test_cert_sha256(test, test_certs[i].sha256, sha256);
+		KUNIT_EXPECT_TRUE(test, is_trusted_cert_size(test_certs[i].size));
+		KUNIT_EXPECT_TRUE(test, is_trusted_cert(test_certs[i].size, sha256));
+		// right hash, wrong size
+		KUNIT_EXPECT_FALSE(test,
+				   is_trusted_cert(test_certs[i].size + 2, sha256));
+	}
+
+	// a trusted size alone is not enough
+	memset(sha256, 0x5a, sizeof(sha256));
+	KUNIT_EXPECT_FALSE(test, is_trusted_cert(0x300, sha256));
+	KUNIT_EXPECT_FALSE(test, is_trusted_cert_size(CERT_MAX_LENGTH + 1));
+
+	// the builtins keep matching next to the added ones
+	for (i = 0; i < ARRAY_SIZE(builtin_certs); i++) {
+		test_cert_sha256(test, builtin_certs[i].sha256, sha256);
+		KUNIT_EXPECT_TRUE(test,
+				  is_trusted_cert(builtin_certs[i].size, sha256));
+	}
+
+	drop_test_certs();
+
+	test_cert_sha256(test, test_certs[2].sha256, sha256);
+	KUNIT_EXPECT_FALSE(test, is_trusted_cert(test_certs[2].size, sha256));
+	KUNIT_EXPECT_FALSE(test, is_trusted_cert_size(test_certs[2].size));
+}
+
+// the fingerprint follows the set, not the order or repeated adds
+static void apk_sign_test_fingerprint(struct kunit *test)
+{
+	u32 builtin = ksu_trusted_certs_fingerprint();
+	u32 one, both;
+
+	mutex_lock(&trusted_mutex);
+	KUNIT_EXPECT_TRUE(test, add_trusted_cert_locked(test_certs[0].size,
+							test_certs[0].sha256,
+							false));
+	one = trusted_fingerprint;
+	KUNIT_EXPECT_TRUE(test, add_trusted_cert_locked(test_certs[1].size,
+							test_certs[1].sha256,
+							false));
+	both = trusted_fingerprint;
+	KUNIT_EXPECT_TRUE(test, add_trusted_cert_locked(test_certs[0].size,
+							test_certs[0].sha256,
+							false));
+	KUNIT_EXPECT_EQ(test, trusted_fingerprint, both);
+	// invalid entries leave the set alone
+	KUNIT_EXPECT_FALSE(test, add_trusted_cert_locked(0, test_certs[0].sha256,
+							 false));
+	KUNIT_EXPECT_FALSE(test, add_trusted_cert_locked(CERT_MAX_LENGTH + 1,
+							 test_certs[0].sha256,
+							 false));
+	KUNIT_EXPECT_FALSE(test, add_trusted_cert_locked(0x300, "00112233",
+							 false));
+	KUNIT_EXPECT_EQ(test, trusted_fingerprint, both);
+	mutex_unlock(&trusted_mutex);
+
+	KUNIT_EXPECT_NE(test, one, builtin);
+	KUNIT_EXPECT_NE(test, both, one);
+
+	// a reload drops what the file added, the builtins stay
+	drop_test_certs();
+	KUNIT_EXPECT_EQ(test, ksu_trusted_certs_fingerprint(), builtin);
+
+	mutex_lock(&trusted_mutex);
+	add_trusted_cert_locked(test_certs[1].size, test_certs[1].sha256, false);
+	add_trusted_cert_locked(test_certs[0].size, test_certs[0].sha256, false);
+	KUNIT_EXPECT_EQ(test, trusted_fingerprint, both);
+	mutex_unlock(&trusted_mutex);
+	drop_test_certs();
+}
+
+static u32 fill_trusted_certs(struct kunit *test, u32 from, u32 to)
+{
+	char hex[SHA256_DIGEST_SIZE * 2 + 1];
+	u32 i;
+
+	mutex_lock(&trusted_mutex);
+	for (i = from; i < to; i++) {
+		snprintf(hex, sizeof(hex), "%08x%056d", i, 0);
+		KUNIT_EXPECT_TRUE(test, add_trusted_cert_locked(0x200 + i % 64,
+								hex, false));
+	}
+	mutex_unlock(&trusted_mutex);
+	return to;
+}
+
+static u64 time_trusted_lookups(u32 count)
+{
+	u8 sha256[SHA256_DIGEST_SIZE] = { 0 };
+	u64 start = ktime_get_ns();
+	u32 i, key;
+
+	for (i = 0; i < TRUSTED_TEST_LOOPS; i++) {
+		key = cpu_to_be32(i % count);
+		memcpy(sha256, &key, sizeof(key));
+		is_trusted_cert(0x200 + i % count % 64, sha256);
+	}
+	return (ktime_get_ns() - start) / TRUSTED_TEST_LOOPS;
+}
+
+// lookups stay flat from a handful of certs to thousands
+static void apk_sign_test_trusted_scaling(struct kunit *test)
+{
+	static const u32 counts[] = { 10, 100, 1000, 5000 };
+	u8 sha256[SHA256_DIGEST_SIZE] = { 0 };
+	u32 filled = 0, key;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(counts); i++) {
+		filled = fill_trusted_certs(test, filled, counts[i]);
+		kunit_info(test, "%u certs: %llu ns/lookup\n", counts[i],
+			   time_trusted_lookups(counts[i]));
+	}
+
+	key = cpu_to_be32(4321);
+	memcpy(sha256, &key, sizeof(key));
+	KUNIT_EXPECT_TRUE(test, is_trusted_cert(0x200 + 4321 % 64, sha256));
+	KUNIT_EXPECT_FALSE(test, is_trusted_cert(0x201 + 4321 % 64, sha256));
+
+	drop_test_certs();
+	KUNIT_EXPECT_FALSE(test, is_trusted_cert(0x200 + 4321 % 64, sha256));
+}
+
+// appends a central directory entry without extra field and comment
+static u32 put_cd_entry(u8 *cd, u32 off, const char *name)
+{
+	u32 magic = 0x02014b50;
+	u16 name_len = strlen(name);
+
+	memset(cd + off, 0, CD_ENTRY_SIZE);
+	memcpy(cd + off, &magic, 4);
+	memcpy(cd + off + 28, &name_len, 2);
+	memcpy(cd + off + CD_ENTRY_SIZE, name, name_len);
+	return off + CD_ENTRY_SIZE + name_len;
+}
+
+// a v2 signed apk that still carries a v1 manifest is refused
+static void apk_sign_test_v1_downgrade(struct kunit *test)
+{
+	struct zip_eocd eocd = { .pos = 100, .cd_size = 64, .cd_offset = 64 };
+	u8 *cd;
+	u32 len;
+
+	cd = kunit_kzalloc(test, 512, GFP_KERNEL);
+	KUNIT_ASSERT_TRUE(test, cd != NULL);
+
+	len = put_cd_entry(cd, 0, "AndroidManifest.xml");
+	len = put_cd_entry(cd, len, "classes.dex");
+	KUNIT_EXPECT_FALSE(test, cd_has_manifest(cd, len));
+
+	len = put_cd_entry(cd, len, "META-INF/MANIFEST.MF");
+	KUNIT_EXPECT_TRUE(test, cd_has_manifest(cd, len));
+
+	// cut inside the manifest name, the entry doesn't count
+	KUNIT_EXPECT_FALSE(test, cd_has_manifest(cd, len - 1));
+
+	// only the exact name counts
+	len = put_cd_entry(cd, 0, "META-INF/MANIFEST.MF.bak");
+	len = put_cd_entry(cd, len, "META-INF/CERT.RSA");
+	KUNIT_EXPECT_FALSE(test, cd_has_manifest(cd, len));
+
+	// a central directory past the EOCD is never read and counts as signed
+	KUNIT_EXPECT_TRUE(test, has_v1_signature_file(NULL, &eocd));
+}
+
+/*
+ * the fixtures of ksud's find_eocd tests: prefix zero bytes, an EOCD and its
+ * comment. the tail handed over is at most the last 64K + 22 bytes, as read
+ * by find_eocd().
+ */
+static u8 *put_eocd(u8 *p, u32 cd_offset, u16 comment_len)
+{
+	u32 magic = 0x06054b50;
+
+	memset(p, 0, EOCD_SIZE);
+	memcpy(p, &magic, 4);
+	memcpy(p + 16, &cd_offset, 4);
+	memcpy(p + 20, &comment_len, 2);
+	return p + EOCD_SIZE;
+}
+
+static bool test_find_eocd(const u8 *data, size_t size, struct zip_eocd *eocd)
+{
+	size_t tail_len = min_t(size_t, size, EOCD_SIZE + EOCD_MAX_COMMENT);
+
+	if (size < EOCD_SIZE)
+		return false;
+	return find_eocd_in_tail(data + size - tail_len, tail_len, size, eocd);
+}
+
+static void apk_sign_test_eocd(struct kunit *test)
+{
+	size_t size = 100 + EOCD_SIZE + EOCD_MAX_COMMENT;
+	struct zip_eocd eocd;
+	u8 *data, *p;
+
+	data = kunit_kzalloc(test, size, GFP_KERNEL);
+	KUNIT_ASSERT_TRUE(test, data != NULL);
+
+	// without comment
+	put_eocd(data, 0, 0);
+	KUNIT_EXPECT_TRUE(test, test_find_eocd(data, EOCD_SIZE, &eocd));
+	KUNIT_EXPECT_EQ(test, eocd.cd_offset, 0U);
+	KUNIT_EXPECT_EQ(test, eocd.pos, (loff_t)0);
+
+	memset(data, 0, size);
+	put_eocd(data + 100, 0x40, 0);
+	KUNIT_EXPECT_TRUE(test, test_find_eocd(data, 100 + EOCD_SIZE, &eocd));
+	KUNIT_EXPECT_EQ(test, eocd.cd_offset, 0x40U);
+	KUNIT_EXPECT_EQ(test, eocd.pos, (loff_t)100);
+
+	// missing
+	memset(data, 0, size);
+	KUNIT_EXPECT_FALSE(test, test_find_eocd(data, 100, &eocd));
+
+	// shorter than an EOCD
+	put_eocd(data, 0, 0);
+	KUNIT_EXPECT_FALSE(test, test_find_eocd(data, EOCD_SIZE - 1, &eocd));
+	KUNIT_EXPECT_FALSE(test, test_find_eocd(data, 0, &eocd));
+
+	// the longest comment, the EOCD is the first byte of the tail
+	memset(data, 0, size);
+	p = put_eocd(data + 100, 0x1234, EOCD_MAX_COMMENT);
+	memset(p, 'c', EOCD_MAX_COMMENT);
+	KUNIT_EXPECT_TRUE(test, test_find_eocd(data, size, &eocd));
+	KUNIT_EXPECT_EQ(test, eocd.cd_offset, 0x1234U);
+	KUNIT_EXPECT_EQ(test, eocd.pos, (loff_t)100);
+
+	// a record in the comment whose length doesn't reach the end is skipped
+	memset(data, 0, size);
+	p = put_eocd(data + 100, 0x40, 2 + EOCD_SIZE + 8);
+	memcpy(p, "xx", 2);
+	p = put_eocd(p + 2, 0x666, 3);
+	memcpy(p, "yyyyyyyy", 8);
+	KUNIT_EXPECT_TRUE(test, test_find_eocd(data, p + 8 - data, &eocd));
+	KUNIT_EXPECT_EQ(test, eocd.cd_offset, 0x40U);
+	KUNIT_EXPECT_EQ(test, eocd.pos, (loff_t)100);
+}
+
+// FIPS 180-2 "abc", the same transform serves every call
+static void apk_sign_test_sha256(struct kunit *test)
+{
+	static const char expected[] =
+		"ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad";
+	u8 want[SHA256_DIGEST_SIZE], got[SHA256_DIGEST_SIZE];
+	struct crypto_shash *tfm;
+	int i;
+
+	KUNIT_ASSERT_EQ(test, hex2bin(want, expected, SHA256_DIGEST_SIZE), 0);
+
+	KUNIT_ASSERT_EQ(test, ksu_sha256((const u8 *)"abc", 3, got), 0);
+	KUNIT_EXPECT_EQ(test, memcmp(got, want, SHA256_DIGEST_SIZE), 0);
+	tfm = sha256_tfm;
+	KUNIT_EXPECT_TRUE(test, tfm != NULL);
+
+	for (i = 0; i < 3; i++) {
+		memset(got, 0, sizeof(got));
+		KUNIT_EXPECT_EQ(test, ksu_sha256((const u8 *)"abc", 3, got), 0);
+		KUNIT_EXPECT_EQ(test, memcmp(got, want, SHA256_DIGEST_SIZE), 0);
+		KUNIT_EXPECT_TRUE(test, sha256_tfm == tfm);
+	}
+}
+
+// per cert cost with the kept transform against one allocated per call
+static void apk_sign_test_sha256_cost(struct kunit *test)
+{
+	u8 digest[SHA256_DIGEST_SIZE];
+	u64 start, kept_ns, fresh_ns;
+	struct crypto_shash *alg;
+	struct sdesc *sdesc;
+	u8 *cert;
+	int i;
+
+	cert = kunit_kzalloc(test, CERT_MAX_LENGTH, GFP_KERNEL);
+	KUNIT_ASSERT_TRUE(test, cert != NULL);
+	KUNIT_ASSERT_EQ(test, ksu_sha256(cert, CERT_MAX_LENGTH, digest), 0);
+
+	start = ktime_get_ns();
+	for (i = 0; i < SHA256_TEST_LOOPS; i++)
+		ksu_sha256(cert, CERT_MAX_LENGTH, digest);
+	kept_ns = ktime_get_ns() - start;
+
+	start = ktime_get_ns();
+	for (i = 0; i < SHA256_TEST_LOOPS; i++) {
+		alg = crypto_alloc_shash("sha256", 0, 0);
+		KUNIT_ASSERT_FALSE(test, IS_ERR(alg));
+		sdesc = init_sdesc(alg);
+		if (!IS_ERR(sdesc)) {
+			crypto_shash_digest(&sdesc->shash, cert,
+					    CERT_MAX_LENGTH, digest);
+			kfree(sdesc);
+		}
+		crypto_free_shash(alg);
+	}
+	fresh_ns = ktime_get_ns() - start;
+
+	kunit_info(test, "kept: %llu ns/cert, allocated: %llu ns/cert\n",
+		   kept_ns / SHA256_TEST_LOOPS, fresh_ns / SHA256_TEST_LOOPS);
+}
+
+static struct kunit_case apk_sign_test_cases[] = {
+	KUNIT_CASE(apk_sign_test_multi_cert),
+	KUNIT_CASE(apk_sign_test_fingerprint),
+	KUNIT_CASE(apk_sign_test_trusted_scaling),
+	KUNIT_CASE(apk_sign_test_v1_downgrade),
+	KUNIT_CASE(apk_sign_test_eocd),
+	KUNIT_CASE(apk_sign_test_sha256),
+	KUNIT_CASE(apk_sign_test_sha256_cost),
+	{}
+};
+
+static struct kunit_suite apk_sign_test_suite = {
+	.name = "ksu_apk_sign",
+	.test_cases = apk_sign_test_cases,
+};
+
+kunit_test_suite(apk_sign_test_suite);
@@ -6,6 +6,8 @@
 #include <linux/init_task.h>
 #include <linux/kernel.h>
 #include <linux/binfmts.h>
+#include <linux/moduleparam.h>
+#include <linux/slab.h>
 
 #ifdef CONFIG_KSU_LSM_SECURITY_HOOKS
 #include <linux/lsm_hooks.h>
@@ -30,6 +32,7 @@
 #endif // #ifdef CONFIG_KSU_SUSFS
 
 #include "allowlist.h"
+#include "grant_map.h"
 #include "core_hook.h"
 #include "klog.h" // IWYU pragma: keep
 #include "ksu.h"
@@ -188,7 +191,9 @@ void ksu_escape_to_root(void)
 		return;
 	}
 
-	struct root_profile *profile = ksu_get_root_profile(cred->uid.val);
+	struct root_profile root_profile;
+	struct root_profile *profile = &root_profile;
+	ksu_get_root_profile(cred->uid.val, profile);
 
 	cred->uid.val = profile->uid;
 	cred->suid.val = profile->uid;
@@ -263,6 +268,7 @@ LSM_HANDLER_TYPE ksu_handle_rename(struct dentry *old_dentry, struct dentry *new
 	pr_info("renameat: %s -> %s, new path: %s\n", old_dentry->d_iname,
 		new_dentry->d_iname, buf);
 
+	ksu_throne_note_rename(old_dentry);
 	ksu_track_throne();
 
 	return 0;
@@ -302,6 +308,19 @@ static bool is_system_bin_su()
 	return (current->mm->exe_file && !strcmp(current->mm->exe_file->f_path.dentry->d_name.name, "su"));
 }
 
+// ksud runs in the su domain straight from KSUD_PATH, a root shell does not
+static bool is_ksud_process()
+{
+	char buf[64];
+	char *path;
+
+	if (!ksu_is_ksu_domain() || !current->mm || !current->mm->exe_file)
+		return false;
+
+	path = d_path(&current->mm->exe_file->f_path, buf, sizeof(buf));
+	return !IS_ERR(path) && !strcmp(path, KSUD_PATH);
+}
+
 LSM_HANDLER_TYPE ksu_handle_prctl(int option, unsigned long arg2, unsigned long arg3,
 		     unsigned long arg4, unsigned long arg5)
 {
@@ -428,10 +447,12 @@ LSM_HANDLER_TYPE ksu_handle_prctl(int option, unsigned long arg2, unsigned long
 		return 0;
 	}
 
+	// room for 128 uids only, a longer list fails instead of being cut
 	if (arg2 == CMD_GET_ALLOW_LIST || arg2 == CMD_GET_DENY_LIST) {
 		u32 array[128];
 		u32 array_length;
-		bool success = ksu_get_allow_list(array, &array_length,
+		bool success = ksu_get_allow_list(array, ARRAY_SIZE(array),
+						  &array_length,
 						  arg2 == CMD_GET_ALLOW_LIST);
 		if (success) {
 			if (!copy_to_user(arg4, &array_length,
@@ -446,7 +467,45 @@ LSM_HANDLER_TYPE ksu_handle_prctl(int option, unsigned long arg2, unsigned long
 			} else {
 				pr_err("prctl copy allowlist error\n");
 			}
+		} else {
+			pr_warn("prctl cmd %lu: more than %zu uids, use CMD_GET_ALLOW_LIST_PAGED\n",
+				arg2, ARRAY_SIZE(array));
+		}
+		return 0;
+	}
+
+	if (arg2 == CMD_GET_ALLOW_LIST_PAGED) {
+		struct ksu_uid_page page;
+		u32 *array;
+		bool done;
+
+		if (copy_from_user(&page, arg3, sizeof(page))) {
+			pr_err("prctl copy uid page error\n");
+			return 0;
+		}
+
+		page.capacity = min_t(u32, page.capacity, KSU_MAX_UID_PAGE);
+		array = kmalloc_array(max_t(u32, page.capacity, 1), sizeof(u32),
+				      GFP_KERNEL);
+		if (!array) {
+			return 0;
+		}
+
+		ksu_get_allow_list_page(array, page.capacity, &page.cursor,
+					&page.count, arg4 != 0,
+					&page.generation, &done);
+		page.done = done;
+
+		if (!copy_to_user((void __user *)(uintptr_t)page.uids, array,
+				  sizeof(u32) * page.count) &&
+		    !copy_to_user(arg3, &page, sizeof(page))) {
+			if (copy_to_user(result, &reply_ok, sizeof(reply_ok))) {
+				pr_err("prctl reply error, cmd: %lu\n", arg2);
+			}
+		} else {
+			pr_err("prctl copy allowlist error\n");
 		}
+		kfree(array);
 		return 0;
 	}
 
@@ -481,6 +540,53 @@ LSM_HANDLER_TYPE ksu_handle_prctl(int option, unsigned long arg2, unsigned long
 		return 0;
 	}
 
+	if (arg2 == CMD_SYNC_ALLOWLIST) {
+		if (!from_root && !from_manager) {
+			return 0;
+		}
+		ksu_sync_allow_list();
+		if (copy_to_user(result, &reply_ok, sizeof(reply_ok))) {
+			pr_err("prctl reply error, cmd: %lu\n", arg2);
+		}
+		return 0;
+	}
+
+	if (arg2 == CMD_GET_GRANT_MAP_FD) {
+		int fd;
+
+		if (!from_root && !from_manager) {
+			return 0;
+		}
+		fd = ksu_grant_map_get_fd((int __user *)arg3);
+		if (fd < 0) {
+			pr_err("get grant map fd failed: %d\n", fd);
+			return 0;
+		}
+		if (copy_to_user(result, &reply_ok, sizeof(reply_ok))) {
+			pr_err("prctl reply error, cmd: %lu\n", arg2);
+		}
+		return 0;
+	}
+
+	if (arg2 == CMD_PUSH_PACKAGES) {
+		int ret;
+
+		// the list decides who the manager is, only ksud may push it
+		if (!from_root || !is_ksud_process()) {
+			return 0;
+		}
+		ret = ksu_throne_push_packages((const void __user *)arg3,
+					       (size_t)arg4);
+		if (ret) {
+			pr_err("push packages failed: %d\n", ret);
+			return 0;
+		}
+		if (copy_to_user(result, &reply_ok, sizeof(reply_ok))) {
+			pr_err("prctl reply error, cmd: %lu\n", arg2);
+		}
+		return 0;
+	}
+
 	if (arg2 == CMD_ENABLE_SU) {
 		bool enabled = (arg3 != 0);
 		if (enabled == ksu_su_compat_enabled) {
@@ -712,6 +818,45 @@ LSM_HANDLER_TYPE ksu_handle_prctl(int option, unsigned long arg2, unsigned long
 		return 0;
 	}
 
+	// arg3: struct app_profile array, arg4: count
+	// entries which are not found get version 0
+	if (arg2 == CMD_GET_APP_PROFILES) {
+		struct app_profile __user *profiles = (struct app_profile __user *)arg3;
+		unsigned long count = (unsigned long)arg4;
+		struct app_profile profile;
+		bool all_ok = true;
+		unsigned long i;
+
+		if (count > KSU_MAX_PROFILE_BATCH) {
+			pr_err("prctl profile batch too large: %lu\n", count);
+			return 0;
+		}
+
+		for (i = 0; i < count; i++) {
+			bool ok;
+
+			if (copy_from_user(&profile, &profiles[i], sizeof(profile))) {
+				pr_err("copy profile failed\n");
+				all_ok = false;
+				break;
+			}
+
+			ok = ksu_get_app_profile(&profile);
+			if (!ok)
+				profile.version = 0;
+			if (copy_to_user(&profiles[i], &profile, sizeof(profile))) {
+				pr_err("copy profile failed\n");
+				all_ok = false;
+				break;
+			}
+		}
+
+		if (all_ok && copy_to_user(result, &reply_ok, sizeof(reply_ok))) {
+			pr_err("prctl reply error, cmd: %lu\n", arg2);
+		}
+		return 0;
+	}
+
 	if (arg2 == CMD_IS_SU_ENABLED) {
 		if (copy_to_user(arg3, &ksu_su_compat_enabled,
 				 sizeof(ksu_su_compat_enabled))) {
@@ -790,12 +935,34 @@ static void try_umount(const char *mnt, int flags)
 }
 
 
+/*
+ * 384 is what throne_tracker uses, something sensible even for /data/app
+ * we can pattern match revanced mounts even.
+ * we are not really interested on mountpoints that are longer than that
+ * this is now up to the modder for tweaking
+ */
+#define KSU_MOUNT_PATH_LEN 384
+
 struct mount_entry {
-    char *umountable;
+    char umountable[KSU_MOUNT_PATH_LEN];
     struct list_head list;
 };
 LIST_HEAD(mount_list);
 
+// mount entries are never freed, they live in their own cache
+static struct kmem_cache *mount_entry_cachep = NULL;
+static unsigned int mount_entry_live = 0;
+module_param_named(mount_entries_live, mount_entry_live, uint, 0444);
+
+static void ksu_mount_monitor_init(void)
+{
+	mount_entry_cachep = kmem_cache_create("ksu_mount_entry",
+					       sizeof(struct mount_entry), 0, 0,
+					       NULL);
+	if (!mount_entry_cachep)
+		pr_err("%s: create mount_entry cache failed\n", __func__);
+}
+
 #ifdef CONFIG_KSU_SUSFS_TRY_UMOUNT
 void susfs_try_umount_all(uid_t uid) {
 	susfs_try_umount(uid);
@@ -806,6 +973,7 @@ void susfs_try_umount_all(uid_t uid) {
 LSM_HANDLER_TYPE ksu_handle_setuid(struct cred *new, const struct cred *old)
 {
 	struct mount_entry *entry, *tmp;
+	u8 decision;
 
 	// this hook is used for umounting overlayfs for some uid, if there isn't any module mounted, just ignore it!
 	if (!ksu_module_mounted) {
@@ -836,6 +1004,7 @@ LSM_HANDLER_TYPE ksu_handle_setuid(struct cred *new, const struct cred *old)
 		if (unlikely(new_uid.val < 10000 && new_uid.val >= 1000)) {
 			// umount for the system process if path DATA_ADB_UMOUNT_FOR_ZYGOTE_SYSTEM_PROCESS exists
 			if (susfs_is_umount_for_zygote_system_process_enabled) {
+				decision = ksu_get_uid_decision(new_uid.val);
 				goto out_ksu_try_umount;
 			}
 		}
@@ -857,7 +1026,9 @@ LSM_HANDLER_TYPE ksu_handle_setuid(struct cred *new, const struct cred *old)
 		goto do_umount;
 	}
 
-	if (ksu_is_allow_uid(new_uid.val)) {
+	// one lookup answers both "granted?" and "umount?"
+	decision = ksu_get_uid_decision(new_uid.val);
+	if (decision & KSU_UID_ALLOW_SU) {
 #ifdef CONFIG_KSU_DEBUG
 		pr_info("handle setuid ignore allowed application: %d\n", new_uid.val);
 #endif
@@ -874,7 +1045,7 @@ LSM_HANDLER_TYPE ksu_handle_setuid(struct cred *new, const struct cred *old)
 #ifdef CONFIG_KSU_SUSFS_SUS_MOUNT
 out_ksu_try_umount:
 #endif
-	if (!ksu_uid_should_umount(new_uid.val)) {
+	if (!(decision & KSU_UID_SHOULD_UMOUNT)) {
 		return 0;
 	} else {
 #ifdef CONFIG_KSU_DEBUG
@@ -921,39 +1092,39 @@ do_umount:
 
 static int ksu_mount_monitor(const char *dev_name, const char *dirname, const char *type)
 {
-
-	char *device_name_copy = kstrdup(dev_name, GFP_KERNEL);
-	char *fstype_copy = kstrdup(type, GFP_KERNEL);
-	char *dirname_copy = kstrdup(dirname, GFP_KERNEL);
-	const char *string_fstype = fstype_copy ? fstype_copy : "(null)";
-	const char *string_devname = device_name_copy ? device_name_copy : "(null)";
+	// the hook hands us kernel copies, nothing to duplicate just to compare
+	const char *string_fstype = type ? type : "(null)";
+	const char *string_devname = dev_name ? dev_name : "(null)";
 	struct mount_entry *new_entry;
 
-	if (unlikely(!dirname_copy)) // if dirname is null thats just questionable
-		goto out;
+	if (unlikely(!dirname)) // if dirname is null thats just questionable
+		return 0;
 	
 	/*
 	 * feel free to add your own patterns
 	 * default one is just KSU devname or it starts with /data/adb/modules
 	 *
 	 * for devicenamme and fstype string comparisons, make sure to use string_fstype/string_devname as NULL is being allowed.
-	 * using device_name_copy, fstype_copy can lead to null pointer dereference.
+	 * using dev_name, type can lead to null pointer dereference.
 	 */
 	if ((!strcmp(string_devname, "KSU")) 
-	//	|| !strcmp(dirname_copy, "/system/etc/hosts") // this is an example
-		|| strstarts(dirname_copy, "/data/adb/modules") ) {
-		new_entry = kmalloc(sizeof(*new_entry), GFP_KERNEL);
+	//	|| !strcmp(dirname, "/system/etc/hosts") // this is an example
+		|| strstarts(dirname, "/data/adb/modules") ) {
+		if (!mount_entry_cachep)
+			return 0;
+		new_entry = kmem_cache_alloc(mount_entry_cachep, GFP_KERNEL);
 		if (new_entry) {
-			new_entry->umountable = kstrdup(dirname, GFP_KERNEL);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 8, 0)
+			strlcpy(new_entry->umountable, dirname, KSU_MOUNT_PATH_LEN);
+#else
+			strscpy(new_entry->umountable, dirname, KSU_MOUNT_PATH_LEN);
+#endif
 			list_add(&new_entry->list, &mount_list);
+			mount_entry_live++;
 			ksu_unmountable_count++;
 			pr_info("%s: devicename: %s fstype: %s path: %s count: %d\n", __func__, string_devname, string_fstype, new_entry->umountable, ksu_unmountable_count);
 		}
 	}
-out:
-	kfree(device_name_copy);
-	kfree(fstype_copy);
-	kfree(dirname_copy);
 	return 0;
 }
 
@@ -961,13 +1132,7 @@ out:
 LSM_HANDLER_TYPE ksu_sb_mount(const char *dev_name, const struct path *path,
                         const char *type, unsigned long flags, void *data)
 {
-	/* 
-	 * 384 is what throne_tracker uses, something sensible even for /data/app
-	 * we can pattern match revanced mounts even.
-	 * we are not really interested on mountpoints that are longer than that
-	 * this is now up to the modder for tweaking
-	 */
-	char buf[384];
+	char buf[KSU_MOUNT_PATH_LEN];
 	char *dir_name = d_path(path, buf, sizeof(buf));
 
 	if (dir_name && dir_name != buf) {
@@ -1070,7 +1235,7 @@ LSM_HANDLER_TYPE ksu_bprm_check(struct linux_binprm *bprm)
 {
 	char *filename = (char *)bprm->filename;
 	
-	if (likely(!ksu_execveat_hook))
+	if (!ksu_hook_key_on(ksu_execveat_key) || !ksu_execveat_hook)
 		return 0;
 
 /*
@@ -1167,11 +1332,13 @@ void __init ksu_lsm_hook_init(void)
 
 void __init ksu_core_init(void)
 {
+	ksu_mount_monitor_init();
 	ksu_lsm_hook_init();
 }
 #else
 void __init ksu_core_init(void)
 {
+	ksu_mount_monitor_init();
 	pr_info("ksu_core_init: LSM hooks not in use.\n");
 }
 #endif //CONFIG_KSU_LSM_SECURITY_HOOKS
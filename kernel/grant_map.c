@@ -0,0 +1,251 @@
+#include <linux/anon_inodes.h>
+#include <linux/fcntl.h>
+#include <linux/file.h>
+#include <linux/fs.h>
+#include <linux/kref.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/types.h>
+#include <linux/uaccess.h>
+#include <linux/version.h>
+#include <linux/vmalloc.h>
+
+#include "grant_map.h"
+#include "klog.h" // IWYU pragma: keep
+#include "ksu.h"
+
+/*
+ * A read only copy of the per-uid decisions for userspace.
+ *
+ * root and manager callers get an anon inode fd which maps the vmalloc'ed
+ * struct ksu_grant_map, so "is this uid granted / should it be unmounted"
+ * becomes a few memory reads instead of a prctl. Writers are serialized by
+ * grant_map_lock and bracket their changes with seq like a seqcount: odd
+ * while writing, readers retry when it's odd or changed under them.
+ *
+ * The map lives as long as any fd (and thus any mapping) of it does.
+ */
+#define PER_USER_RANGE 100000
+
+struct grant_map_ref {
+	struct kref kref;
+	struct ksu_grant_map *map;
+};
+
+static struct grant_map_ref *grant_map = NULL;
+static DEFINE_SPINLOCK(grant_map_lock);
+static u8 next_slot = 0;
+
+static void grant_map_free(struct kref *kref)
+{
+	struct grant_map_ref *ref = container_of(kref, struct grant_map_ref, kref);
+
+	vfree(ref->map);
+	kfree(ref);
+}
+
+// mapped readers load seq without any lock, so publish it in one store
+static inline void write_begin(struct ksu_grant_map *map)
+{
+	WRITE_ONCE(map->seq, map->seq + 1);
+	smp_wmb();
+}
+
+static inline void write_end(struct ksu_grant_map *map)
+{
+	smp_wmb();
+	WRITE_ONCE(map->seq, map->seq + 1);
+}
+
+static inline void assign_bit64(u64 *words, u32 nr, bool value)
+{
+	if (value)
+		words[nr / 64] |= 1ULL << (nr % 64);
+	else
+		words[nr / 64] &= ~(1ULL << (nr % 64));
+}
+
+void ksu_grant_map_update(uid_t uid, bool granted, bool explicit_umount,
+			  bool umount)
+{
+	struct ksu_grant_map_slot *slot;
+	struct ksu_grant_map *map;
+	u32 user = uid / PER_USER_RANGE;
+	u32 appid = uid % PER_USER_RANGE;
+	u8 index;
+
+	if (user >= KSU_GRANT_MAP_USERS || appid >= KSU_GRANT_MAP_APPIDS)
+		return;
+
+	// grant_map goes away under the lock in ksu_grant_map_exit
+	spin_lock(&grant_map_lock);
+	if (!grant_map)
+		goto out;
+
+	map = grant_map->map;
+	index = map->user_slot[user];
+	if (!index) {
+		if (!granted && !explicit_umount && !umount)
+			goto out; // nothing to record for this user yet
+
+		if (next_slot >= KSU_GRANT_MAP_SLOTS) {
+			// readers fall back to the prctl for users without a slot
+			if (!map->incomplete) {
+				pr_warn("grant map: out of user slots\n");
+				write_begin(map);
+				map->incomplete = 1;
+				write_end(map);
+			}
+			goto out;
+		}
+		index = ++next_slot;
+	}
+
+	slot = &map->slots[index - 1];
+
+	write_begin(map);
+	map->user_slot[user] = index;
+	assign_bit64(slot->granted, appid, granted);
+	assign_bit64(slot->explicit_umount, appid, explicit_umount);
+	assign_bit64(slot->umount, appid, umount);
+	write_end(map);
+out:
+	spin_unlock(&grant_map_lock);
+}
+
+void ksu_grant_map_set_default_umount(bool umount)
+{
+	spin_lock(&grant_map_lock);
+	if (!grant_map)
+		goto out;
+
+	write_begin(grant_map->map);
+	grant_map->map->default_umount = umount;
+	write_end(grant_map->map);
+out:
+	spin_unlock(&grant_map_lock);
+}
+
+void ksu_grant_map_set_manager(uid_t uid)
+{
+	spin_lock(&grant_map_lock);
+	if (!grant_map)
+		goto out;
+
+	write_begin(grant_map->map);
+	grant_map->map->manager_uid = uid;
+	write_end(grant_map->map);
+out:
+	spin_unlock(&grant_map_lock);
+}
+
+static int grant_map_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct grant_map_ref *ref = file->private_data;
+
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+
+	// no mprotect(PROT_WRITE) later either
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+	vm_flags_clear(vma, VM_MAYWRITE);
+#else
+	vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+
+	return remap_vmalloc_range(vma, ref->map, vma->vm_pgoff);
+}
+
+static int grant_map_release(struct inode *inode, struct file *file)
+{
+	struct grant_map_ref *ref = file->private_data;
+
+	kref_put(&ref->kref, grant_map_free);
+	return 0;
+}
+
+static const struct file_operations grant_map_fops = {
+	.owner = THIS_MODULE,
+	.mmap = grant_map_mmap,
+	.release = grant_map_release,
+};
+
+int ksu_grant_map_get_fd(int __user *ufd)
+{
+	struct grant_map_ref *ref;
+	struct file *file;
+	int fd;
+
+	spin_lock(&grant_map_lock);
+	ref = grant_map;
+	if (ref)
+		kref_get(&ref->kref);
+	spin_unlock(&grant_map_lock);
+
+	if (!ref)
+		return -ENOMEM;
+
+	fd = get_unused_fd_flags(O_CLOEXEC);
+	if (fd < 0) {
+		kref_put(&ref->kref, grant_map_free);
+		return fd;
+	}
+
+	file = anon_inode_getfile("[ksu_grant_map]", &grant_map_fops, ref,
+				  O_RDONLY);
+	if (IS_ERR(file)) {
+		kref_put(&ref->kref, grant_map_free);
+		put_unused_fd(fd);
+		return PTR_ERR(file);
+	}
+
+	// only publish the fd once the caller knows about it
+	if (copy_to_user(ufd, &fd, sizeof(fd))) {
+		fput(file); // drops our kref in release
+		put_unused_fd(fd);
+		return -EFAULT;
+	}
+
+	fd_install(fd, file);
+	return fd;
+}
+
+void ksu_grant_map_init(void)
+{
+	struct grant_map_ref *ref;
+
+	ref = kzalloc(sizeof(*ref), GFP_KERNEL);
+	if (!ref) {
+		pr_err("grant map alloc failed\n");
+		return;
+	}
+
+	// vmalloc_user: zeroed and allowed to be mapped to userspace
+	ref->map = vmalloc_user(sizeof(struct ksu_grant_map));
+	if (!ref->map) {
+		pr_err("grant map alloc failed\n");
+		kfree(ref);
+		return;
+	}
+
+	kref_init(&ref->kref);
+	ref->map->magic = KSU_GRANT_MAP_MAGIC;
+	ref->map->manager_uid = (u32)-1;
+	ref->map->default_umount = 1;
+	grant_map = ref;
+}
+
+void ksu_grant_map_exit(void)
+{
+	struct grant_map_ref *ref = grant_map;
+
+	if (!ref)
+		return;
+
+	spin_lock(&grant_map_lock);
+	grant_map = NULL;
+	spin_unlock(&grant_map_lock);
+
+	kref_put(&ref->kref, grant_map_free);
+}
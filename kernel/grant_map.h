@@ -0,0 +1,22 @@
+#ifndef __KSU_H_GRANT_MAP
+#define __KSU_H_GRANT_MAP
+
+#include <linux/types.h>
+
+void ksu_grant_map_init(void);
+
+void ksu_grant_map_exit(void);
+
+// uid must be below KSU_GRANT_MAP_USERS * 100000 with an appid below KSU_GRANT_MAP_APPIDS
+void ksu_grant_map_update(uid_t uid, bool granted, bool explicit_umount,
+			  bool umount);
+
+void ksu_grant_map_set_default_umount(bool umount);
+
+void ksu_grant_map_set_manager(uid_t uid);
+
+// install a new read only fd for the caller and store it to ufd,
+// mmap it to read struct ksu_grant_map
+int ksu_grant_map_get_fd(int __user *ufd);
+
+#endif
@@ -1,5 +1,7 @@
 #include <linux/version.h>
 #include <linux/fs.h>
+#include <linux/mount.h>
+#include <linux/namei.h>
 #include <linux/nsproxy.h>
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 10, 0)
 #include <linux/sched/task.h>
@@ -76,7 +78,7 @@ void ksu_android_ns_fs_check()
 	task_unlock(current);
 }
 
-struct file *ksu_filp_open_compat(const char *filename, int flags, umode_t mode)
+static void ksu_enter_android_context(struct ksu_ns_fs_saved *saved)
 {
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4, 10, 0) || defined(CONFIG_KSU_ALLOWLIST_WORKAROUND)
 	if (init_session_keyring != NULL && !current_cred()->session_keyring &&
@@ -86,28 +88,146 @@ struct file *ksu_filp_open_compat(const char *filename, int flags, umode_t mode)
 	}
 #endif
 	// switch mnt_ns even if current is not wq_worker, to ensure what we open is the correct file in android mnt_ns, rather than user created mnt_ns
-	struct ksu_ns_fs_saved saved;
 	if (android_context_saved_enabled) {
 #ifdef CONFIG_KSU_DEBUG
 		pr_info("start switch current nsproxy and fs to android context\n");
 #endif
 		task_lock(current);
-		ksu_save_ns_fs(&saved);
+		ksu_save_ns_fs(saved);
 		ksu_load_ns_fs(&android_context_saved);
 		task_unlock(current);
 	}
-	struct file *fp = filp_open(filename, flags, mode);
+}
+
+static void ksu_leave_android_context(struct ksu_ns_fs_saved *saved)
+{
 	if (android_context_saved_enabled) {
 		task_lock(current);
-		ksu_load_ns_fs(&saved);
+		ksu_load_ns_fs(saved);
 		task_unlock(current);
 #ifdef CONFIG_KSU_DEBUG
 		pr_info("switch current nsproxy and fs back to saved successfully\n");
 #endif
 	}
+}
+
+struct file *ksu_filp_open_compat(const char *filename, int flags, umode_t mode)
+{
+	struct ksu_ns_fs_saved saved;
+	struct file *fp;
+
+	ksu_enter_android_context(&saved);
+	fp = filp_open(filename, flags, mode);
+	ksu_leave_android_context(&saved);
+
 	return fp;
 }
 
+static struct dentry *ksu_lookup_compat(const char *name, struct dentry *dir)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 16, 0)
+	return lookup_noperm(&QSTR(name), dir);
+#else
+	return lookup_one_len(name, dir, strlen(name));
+#endif
+}
+
+static int ksu_vfs_rename_compat(struct dentry *dir, struct dentry *old_dentry,
+				 struct dentry *new_dentry)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 17, 0)
+	struct renamedata rd = {
+		.mnt_idmap = &nop_mnt_idmap,
+		.old_parent = dir,
+		.old_dentry = old_dentry,
+		.new_parent = dir,
+		.new_dentry = new_dentry,
+	};
+	return vfs_rename(&rd);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+	struct renamedata rd = {
+		.old_mnt_idmap = &nop_mnt_idmap,
+		.old_dir = d_inode(dir),
+		.old_dentry = old_dentry,
+		.new_mnt_idmap = &nop_mnt_idmap,
+		.new_dir = d_inode(dir),
+		.new_dentry = new_dentry,
+	};
+	return vfs_rename(&rd);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5, 12, 0)
+	struct renamedata rd = {
+		.old_mnt_userns = &init_user_ns,
+		.old_dir = d_inode(dir),
+		.old_dentry = old_dentry,
+		.new_mnt_userns = &init_user_ns,
+		.new_dir = d_inode(dir),
+		.new_dentry = new_dentry,
+	};
+	return vfs_rename(&rd);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(3, 15, 0)
+	return vfs_rename(dir->d_inode, old_dentry, dir->d_inode, new_dentry,
+			  NULL, 0);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(3, 13, 0)
+	return vfs_rename(dir->d_inode, old_dentry, dir->d_inode, new_dentry,
+			  NULL);
+#else
+	return vfs_rename(dir->d_inode, old_dentry, dir->d_inode, new_dentry);
+#endif
+}
+
+// atomically replace dir/newname with dir/oldname, both live in the same directory
+int ksu_rename_compat(const char *dirname, const char *oldname,
+		      const char *newname)
+{
+	struct ksu_ns_fs_saved saved;
+	struct dentry *old_dentry, *new_dentry;
+	struct path dir;
+	int err;
+
+	ksu_enter_android_context(&saved);
+
+	err = kern_path(dirname, LOOKUP_FOLLOW | LOOKUP_DIRECTORY, &dir);
+	if (err)
+		goto out;
+
+	// like do_renameat2, respect frozen and read-only mounts
+	err = mnt_want_write(dir.mnt);
+	if (err)
+		goto out_put_dir;
+
+	lock_rename(dir.dentry, dir.dentry);
+
+	old_dentry = ksu_lookup_compat(oldname, dir.dentry);
+	if (IS_ERR(old_dentry)) {
+		err = PTR_ERR(old_dentry);
+		goto out_unlock;
+	}
+	if (!old_dentry->d_inode) {
+		err = -ENOENT;
+		goto out_put_old;
+	}
+
+	new_dentry = ksu_lookup_compat(newname, dir.dentry);
+	if (IS_ERR(new_dentry)) {
+		err = PTR_ERR(new_dentry);
+		goto out_put_old;
+	}
+
+	err = ksu_vfs_rename_compat(dir.dentry, old_dentry, new_dentry);
+
+	dput(new_dentry);
+out_put_old:
+	dput(old_dentry);
+out_unlock:
+	unlock_rename(dir.dentry, dir.dentry);
+	mnt_drop_write(dir.mnt);
+out_put_dir:
+	path_put(&dir);
+out:
+	ksu_leave_android_context(&saved);
+	return err;
+}
+
 ssize_t ksu_kernel_read_compat(struct file *p, void *buf, size_t count,
 			       loff_t *pos)
 {
@@ -13,6 +13,8 @@ extern struct key *init_session_keyring;
 extern void ksu_android_ns_fs_check();
 extern struct file *ksu_filp_open_compat(const char *filename, int flags,
 					 umode_t mode);
+extern int ksu_rename_compat(const char *dirname, const char *oldname,
+			     const char *newname);
 extern ssize_t ksu_kernel_read_compat(struct file *p, void *buf, size_t count,
 				      loff_t *pos);
 extern ssize_t ksu_kernel_write_compat(struct file *p, const void *buf,
@@ -40,6 +42,27 @@ static long ksu_copy_from_user_retry(void *to,
 	return copy_from_user(to, from, count);
 }
 
+/*
+ * hooks that start enabled and get turned off for good sit behind a static
+ * key, a disabled one is a nop in the hot path. the static_branch api is
+ * 4.3+, older kernels and kernels without jump labels get a plain bool.
+ * enable / disable may sleep.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 3, 0) && defined(CONFIG_JUMP_LABEL)
+#include <linux/jump_label.h>
+#define KSU_DEFINE_HOOK_KEY(name) DEFINE_STATIC_KEY_TRUE(name)
+#define KSU_DECLARE_HOOK_KEY(name) DECLARE_STATIC_KEY_TRUE(name)
+#define ksu_hook_key_on(name) static_branch_unlikely(&name)
+#define ksu_hook_key_enable(name) static_branch_enable(&name)
+#define ksu_hook_key_disable(name) static_branch_disable(&name)
+#else
+#define KSU_DEFINE_HOOK_KEY(name) bool name __read_mostly = true
+#define KSU_DECLARE_HOOK_KEY(name) extern bool name
+#define ksu_hook_key_on(name) (name)
+#define ksu_hook_key_enable(name) (name = true)
+#define ksu_hook_key_disable(name) (name = false)
+#endif
+
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3, 11, 0) && !defined(KSU_HAS_ITERATE_DIR)
 struct dir_context {
 	const filldir_t actor;
@@ -8,6 +8,7 @@
 #include <linux/workqueue.h>
 
 #include "allowlist.h"
+#include "apk_sign.h"
 #include "core_hook.h"
 #include "klog.h" // IWYU pragma: keep
 #include "ksu.h"
@@ -24,6 +25,16 @@ bool ksu_queue_work(struct work_struct *work)
 	return queue_work(ksu_workqueue, work);
 }
 
+bool ksu_mod_delayed_work(struct delayed_work *work, unsigned long delay)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 7, 0)
+	return mod_delayed_work(ksu_workqueue, work, delay);
+#else
+	// no mod_delayed_work, a pending work just keeps its timer
+	return queue_delayed_work(ksu_workqueue, work, delay);
+#endif
+}
+
 // track backports and other quirks here
 // ref: kernel_compat.c, Makefile
 // yes looks nasty
@@ -106,6 +117,8 @@ int __init ksu_kernelsu_init(void)
 
 	ksu_throne_tracker_init();
 
+	ksu_apk_sign_init();
+
 	return 0;
 }
 
@@ -115,6 +128,8 @@ void ksu_kernelsu_exit(void)
 
 	ksu_throne_tracker_exit();
 
+	ksu_apk_sign_exit();
+
 	destroy_workqueue(ksu_workqueue);
 
 }
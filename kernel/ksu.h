@@ -24,6 +24,14 @@
 #define CMD_IS_SU_ENABLED 14
 #define CMD_ENABLE_SU 15
 #define CMD_GET_MANAGER_UID 16
+#define CMD_SYNC_ALLOWLIST 17
+#define CMD_GET_APP_PROFILES 19
+#define CMD_GET_ALLOW_LIST_PAGED 20
+#define CMD_GET_GRANT_MAP_FD 21
+#define CMD_PUSH_PACKAGES 22
+
+// upper bound of profiles in one CMD_GET_APP_PROFILES
+#define KSU_MAX_PROFILE_BATCH 4096
 
 #define EVENT_POST_FS_DATA 1
 #define EVENT_BOOT_COMPLETED 2
@@ -83,7 +91,76 @@ struct app_profile {
 	};
 };
 
+// CMD_GET_ALLOW_LIST_PAGED, arg4: true for allowed uids, false for denied
+struct ksu_uid_page {
+	u32 cursor; // in: 0 for the first page, out: cursor of the next page
+	u32 capacity; // in: number of entries uids can hold
+	u32 count; // out: number of entries written
+	u32 generation; // out: changes whenever the list changes
+	u32 done; // out: 1 if this is the last page
+	u32 reserved;
+	u64 uids; // in: user pointer to a u32 array
+};
+
+// kernel side chunk of one CMD_GET_ALLOW_LIST_PAGED call
+#define KSU_MAX_UID_PAGE 1024
+
+/*
+ * CMD_GET_GRANT_MAP_FD returns an fd in arg3 (int *), mmap it read only to
+ * get struct ksu_grant_map. For uid = user * 100000 + appid with an appid
+ * below KSU_GRANT_MAP_APPIDS, slot = user_slot[user]:
+ *  - slot 0: no profile in this user (ask the kernel if incomplete is set)
+ *  - granted: slots[slot - 1].granted bit appid
+ *  - should umount: never for the manager, else explicit_umount ? umount : default_umount.
+ *    only the first profile of a uid counts, a granted one is explicit without umount
+ * read seq before and after, retry if it is odd or changed.
+ */
+#define KSU_GRANT_MAP_MAGIC 0x4b53474d // 'KSGM'
+#define KSU_GRANT_MAP_USERS 1024
+#define KSU_GRANT_MAP_SLOTS 16
+#define KSU_GRANT_MAP_APPIDS 20000 // LAST_APPLICATION_UID + 1
+#define KSU_GRANT_MAP_WORDS ((KSU_GRANT_MAP_APPIDS + 63) / 64)
+
+struct ksu_grant_map_slot {
+	u64 granted[KSU_GRANT_MAP_WORDS];
+	u64 explicit_umount[KSU_GRANT_MAP_WORDS];
+	u64 umount[KSU_GRANT_MAP_WORDS];
+};
+
+struct ksu_grant_map {
+	u32 magic;
+	u32 seq;
+	u32 manager_uid;
+	u32 default_umount;
+	u32 incomplete; // some users have no slot
+	u32 reserved;
+	u8 user_slot[KSU_GRANT_MAP_USERS];
+	struct ksu_grant_map_slot slots[KSU_GRANT_MAP_SLOTS];
+};
+
+/*
+ * CMD_PUSH_PACKAGES, root only. arg3: buffer, arg4: its size.
+ * A ksu_packages_header followed by count records, each one is
+ * u32 uid, u8 op, u8 len and len bytes of package name (no '\0'), unaligned.
+ * The first push must have KSU_PACKAGES_FULL, it replaces the whole list and
+ * stops the kernel from parsing packages.list while the pushing process lives.
+ */
+#define KSU_PACKAGES_MAGIC 0x4b53504b // 'KSPK'
+#define KSU_PACKAGES_FULL 1
+#define KSU_PACKAGE_ADD 1
+#define KSU_PACKAGE_REMOVE 2
+#define KSU_PACKAGE_RECORD_HEADER 6
+#define KSU_MAX_PACKAGES_PUSH (4 << 20)
+
+struct ksu_packages_header {
+	u32 magic;
+	u32 flags;
+	u32 count;
+	u32 reserved;
+};
+
 bool ksu_queue_work(struct work_struct *work);
+bool ksu_mod_delayed_work(struct delayed_work *work, unsigned long delay);
 
 static inline int startswith(char *s, char *prefix)
 {
@@ -25,6 +25,7 @@
 #endif
 
 #include "allowlist.h"
+#include "apk_sign.h"
 #include "klog.h" // IWYU pragma: keep
 #include "ksud.h"
 #include "kernel_compat.h"
@@ -57,10 +58,16 @@ static void stop_vfs_read_hook();
 static void stop_execve_hook();
 static void stop_input_hook();
 
+// the kernel side of the manual hooks checks these
 bool ksu_vfs_read_hook __read_mostly = true;
 bool ksu_execveat_hook __read_mostly = true;
 bool ksu_input_hook __read_mostly = true;
 
+// and the handlers check these, they follow the bools from hook_keys_work
+static KSU_DEFINE_HOOK_KEY(ksu_vfs_read_key);
+KSU_DEFINE_HOOK_KEY(ksu_execveat_key);
+static KSU_DEFINE_HOOK_KEY(ksu_input_key);
+
 u32 ksu_devpts_sid;
 
 void ksu_on_post_fs_data(void)
@@ -73,6 +80,7 @@ void ksu_on_post_fs_data(void)
 	done = true;
 	pr_info("ksu_on_post_fs_data!\n");
 	ksu_load_allow_list();
+	ksu_load_trusted_certs();
 	// sanity check, this may influence the performance
 	stop_input_hook();
 
@@ -95,7 +103,7 @@ static int ksu_handle_bprm_ksud(const char *filename, const char *argv1, const c
 	static bool init_second_stage_executed = false;
 
 	// return early when disabled
-	if (!ksu_execveat_hook)
+	if (!ksu_hook_key_on(ksu_execveat_key) || !ksu_execveat_hook)
 		return 0;
 
 	if (!filename)
@@ -167,7 +175,7 @@ first_app_process:
 
 int ksu_handle_pre_ksud(const char *filename)
 {
-	if (likely(!ksu_execveat_hook))
+	if (!ksu_hook_key_on(ksu_execveat_key) || !ksu_execveat_hook)
 		return 0;
 
 	// not /system/bin/init, not /init, not /system/bin/app_process (64/32 thingy)
@@ -262,7 +270,7 @@ int ksu_handle_vfs_read(struct file **file_ptr, char __user **buf_ptr,
 			size_t *count_ptr, loff_t **pos)
 {
 
-	if (!ksu_vfs_read_hook) {
+	if (!ksu_hook_key_on(ksu_vfs_read_key) || !ksu_vfs_read_hook) {
 		return 0;
 	}
 
@@ -376,7 +384,7 @@ static bool is_volumedown_enough(unsigned int count)
 int ksu_handle_input_handle_event(unsigned int *type, unsigned int *code,
 				  int *value)
 {
-	if (!ksu_input_hook) {
+	if (!ksu_hook_key_on(ksu_input_key) || !ksu_input_hook) {
 		return 0;
 	}
 
@@ -436,33 +444,38 @@ __maybe_unused int ksu_handle_compat_execve_ksud(const char __user *filename_use
 bool is_ksu_transition(const struct task_security_struct *old_tsec,
 			const struct task_security_struct *new_tsec)
 {
-	static u32 ksu_sid;
-	char *secdata;
-	u32 seclen;
-	bool allowed = false;
-
-	if (!ksu_sid)
-		security_secctx_to_secid("u:r:su:s0", strlen("u:r:su:s0"), &ksu_sid);
-
-	if (security_secid_to_secctx(old_tsec->sid, &secdata, &seclen))
-		return false;
-
-	allowed = (!strcmp("u:r:init:s0", secdata) && new_tsec->sid == ksu_sid);
-	security_release_secctx(secdata, seclen);
-	
-	return allowed;
+	return ksu_is_init_sid(old_tsec->sid) && ksu_is_su_sid(new_tsec->sid);
 }
 #endif
 
+/*
+ * patching a static key sleeps and the hooks may be stopped from atomic
+ * context (input events come under a spinlock), so the bools go off right
+ * away and the keys follow from a work.
+ */
+static void sync_hook_keys(struct work_struct *work)
+{
+	if (!ksu_vfs_read_hook)
+		ksu_hook_key_disable(ksu_vfs_read_key);
+	if (!ksu_execveat_hook)
+		ksu_hook_key_disable(ksu_execveat_key);
+	if (!ksu_input_hook)
+		ksu_hook_key_disable(ksu_input_key);
+}
+
+static DECLARE_WORK(hook_keys_work, sync_hook_keys);
+
 static void stop_vfs_read_hook()
 {
 	ksu_vfs_read_hook = false;
+	schedule_work(&hook_keys_work);
 	pr_info("stop vfs_read_hook\n");
 }
 
 static void stop_execve_hook()
 {
 	ksu_execveat_hook = false;
+	schedule_work(&hook_keys_work);
 	pr_info("stop execve_hook\n");
 }
 
@@ -470,6 +483,7 @@ static void stop_input_hook()
 {
 	if (!ksu_input_hook) { return; }
 	ksu_input_hook = false;
+	schedule_work(&hook_keys_work);
 	pr_info("stop input_hook\n");
 }
 
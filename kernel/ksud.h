@@ -3,6 +3,8 @@
 
 #include <linux/types.h>
 
+#include "kernel_compat.h"
+
 #define KSUD_PATH "/data/adb/ksud"
 
 void ksu_on_post_fs_data(void);
@@ -12,6 +14,7 @@ bool ksu_is_safe_mode(void);
 extern u32 ksu_devpts_sid;
 
 extern bool ksu_execveat_hook __read_mostly;
+KSU_DECLARE_HOOK_KEY(ksu_execveat_key);
 extern int ksu_handle_pre_ksud(const char *filename);
 
 #endif
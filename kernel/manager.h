@@ -4,6 +4,8 @@
 #include <linux/cred.h>
 #include <linux/types.h>
 
+#include "grant_map.h"
+
 #define KSU_INVALID_UID -1
 
 extern uid_t ksu_manager_uid; // DO NOT DIRECT USE
@@ -26,11 +28,13 @@ static inline uid_t ksu_get_manager_uid()
 static inline void ksu_set_manager_uid(uid_t uid)
 {
 	ksu_manager_uid = uid;
+	ksu_grant_map_set_manager(uid);
 }
 
 static inline void ksu_invalidate_manager_uid()
 {
 	ksu_manager_uid = KSU_INVALID_UID;
+	ksu_grant_map_set_manager(KSU_INVALID_UID);
 }
 
 #endif
@@ -149,6 +149,8 @@ void ksu_apply_kernelsu_rules()
 #endif
 
 	mutex_unlock(&ksu_rules);
+
+	ksu_selinux_refresh_sid_cache();
 }
 
 #define MAX_SEPOL_LEN 128
@@ -560,5 +562,9 @@ exit:
 	// we are in atomic context. so we just reset it every time.
 	reset_avc_cache();
 
+	// only these can add types, ksud sends one statement per call
+	if (!ret && (cmd == CMD_TYPE || cmd == CMD_TYPE_ATTR || cmd == CMD_ATTR))
+		ksu_selinux_refresh_sid_cache();
+
 	return ret;
 }
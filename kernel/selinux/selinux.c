@@ -1,21 +1,181 @@
 #include "selinux.h"
 #include "objsec.h"
+#include "linux/spinlock.h"
 #include "linux/version.h"
+#include "linux/workqueue.h"
 #include "../klog.h" // IWYU pragma: keep
+#include "../ksu.h"
 #ifndef KSU_COMPAT_USE_SELINUX_STATE
 #include "avc.h"
 #endif
 
 #define KERNEL_SU_DOMAIN "u:r:su:s0"
-
-#ifdef CONFIG_KSU_SUSFS
 #define KERNEL_INIT_DOMAIN "u:r:init:s0"
 #define KERNEL_ZYGOTE_DOMAIN "u:r:zygote:s0"
+
+#ifdef CONFIG_KSU_SUSFS
 u32 susfs_ksu_sid = 0;
 u32 susfs_init_sid = 0;
 u32 susfs_zygote_sid = 0;
 #endif
 
+/*
+ * SID cache
+ *
+ * the checks below run for every root caller of the hooked syscalls and for
+ * every setuid from a root process, so instead of a secid -> secctx round
+ * trip and a strcmp we resolve the contexts we care about to sids once.
+ * the cache is refreshed after we touch the policy (ksu_apply_kernelsu_rules,
+ * ksu_handle_sepolicy). a policy load by anyone else bumps the avc policy
+ * seqno, the sids resolved under an older seqno are not trusted anymore and
+ * the checks use the string comparison until a refresh caught up. a zero sid
+ * means "not resolved yet" and falls back the same way.
+ */
+#define SID_CACHE_INVALID ((u32)~0U)
+
+static u32 ksu_su_sid __read_mostly = 0;
+static u32 ksu_zygote_sid __read_mostly = 0;
+static u32 ksu_init_sid __read_mostly = 0;
+// policy seqno the sids above were resolved under
+static u32 sid_cache_seqno __read_mostly = SID_CACHE_INVALID;
+
+static void refresh_sid_cache_work(struct work_struct *work)
+{
+	ksu_selinux_refresh_sid_cache();
+}
+static DECLARE_WORK(sid_refresh_work, refresh_sid_cache_work);
+
+// profile domains, tiny and replaced round robin
+#define DOMAIN_SID_CACHE_SIZE 8
+struct domain_sid {
+	char domain[KSU_SELINUX_DOMAIN];
+	u32 sid;
+};
+static struct domain_sid domain_sid_cache[DOMAIN_SID_CACHE_SIZE];
+static unsigned int domain_sid_next = 0;
+static DEFINE_SPINLOCK(domain_sid_lock);
+
+static inline u32 policy_seqno(void)
+{
+#if ((!defined(KSU_COMPAT_USE_SELINUX_STATE)) || \
+	LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0))
+	return avc_policy_seqno();
+#else
+	return avc_policy_seqno(&selinux_state);
+#endif
+}
+
+static inline bool sid_cache_valid(void)
+{
+	u32 seqno = READ_ONCE(sid_cache_seqno);
+
+	smp_rmb(); // pairs with ksu_selinux_refresh_sid_cache
+	return seqno != SID_CACHE_INVALID && seqno == policy_seqno();
+}
+
+static u32 resolve_sid(const char *context)
+{
+	u32 sid = 0;
+	if (security_secctx_to_secid(context, strlen(context), &sid))
+		return 0;
+	return sid;
+}
+
+void ksu_selinux_refresh_sid_cache(void)
+{
+	// taken first, a load while we resolve leaves the cache stale
+	u32 seqno = policy_seqno();
+	u32 su = resolve_sid(KERNEL_SU_DOMAIN);
+	u32 zygote = resolve_sid(KERNEL_ZYGOTE_DOMAIN);
+	u32 init = resolve_sid(KERNEL_INIT_DOMAIN);
+	bool changed = su != ksu_su_sid || zygote != ksu_zygote_sid ||
+		       init != ksu_init_sid;
+
+	WRITE_ONCE(sid_cache_seqno, SID_CACHE_INVALID);
+	smp_wmb();
+	WRITE_ONCE(ksu_su_sid, su);
+	WRITE_ONCE(ksu_zygote_sid, zygote);
+	WRITE_ONCE(ksu_init_sid, init);
+
+	spin_lock(&domain_sid_lock);
+	memset(domain_sid_cache, 0, sizeof(domain_sid_cache));
+	domain_sid_next = 0;
+	spin_unlock(&domain_sid_lock);
+
+	smp_wmb();
+	WRITE_ONCE(sid_cache_seqno, seqno);
+
+	if (changed)
+		pr_info("sid cache: su: %u, zygote: %u, init: %u\n", ksu_su_sid,
+			ksu_zygote_sid, ksu_init_sid);
+}
+
+static int get_domain_sid(const char *domain, u32 *out_sid)
+{
+	int i, error;
+	u32 sid;
+
+	if (!sid_cache_valid())
+		goto resolve;
+
+	if (ksu_su_sid && !strcmp(domain, KERNEL_SU_DOMAIN)) {
+		*out_sid = ksu_su_sid;
+		return 0;
+	}
+
+	spin_lock(&domain_sid_lock);
+	for (i = 0; i < DOMAIN_SID_CACHE_SIZE; i++) {
+		if (domain_sid_cache[i].sid &&
+		    !strncmp(domain_sid_cache[i].domain, domain,
+			     KSU_SELINUX_DOMAIN)) {
+			*out_sid = domain_sid_cache[i].sid;
+			spin_unlock(&domain_sid_lock);
+			return 0;
+		}
+	}
+	spin_unlock(&domain_sid_lock);
+
+resolve:
+	// may sleep, resolve it outside of the lock
+	error = security_secctx_to_secid(domain, strlen(domain), &sid);
+	if (error)
+		return error;
+
+	if (strlen(domain) < KSU_SELINUX_DOMAIN) {
+		spin_lock(&domain_sid_lock);
+		i = domain_sid_next++ % DOMAIN_SID_CACHE_SIZE;
+		strcpy(domain_sid_cache[i].domain, domain);
+		domain_sid_cache[i].sid = sid;
+		spin_unlock(&domain_sid_lock);
+	}
+
+	*out_sid = sid;
+	return 0;
+}
+
+static bool is_sid_match(u32 sid, const u32 *cached, const char *context)
+{
+	bool valid = sid_cache_valid();
+	u32 cached_sid = READ_ONCE(*cached);
+	char *domain;
+	u32 seclen;
+	bool result;
+
+	if (likely(valid && cached_sid))
+		return sid == cached_sid;
+
+	// the policy was reloaded under us, resolve again in the background
+	if (cached_sid && !valid)
+		ksu_queue_work(&sid_refresh_work);
+
+	// policy not loaded yet or reloaded, slow path
+	if (security_secid_to_secctx(sid, &domain, &seclen))
+		return false;
+	result = strncmp(context, domain, seclen) == 0;
+	security_release_secctx(domain, seclen);
+	return result;
+}
+
 static int transive_to_domain(const char *domain)
 {
 	struct cred *cred;
@@ -31,7 +191,7 @@ static int transive_to_domain(const char *domain)
 		return -1;
 	}
 
-	error = security_secctx_to_secid(domain, strlen(domain), &sid);
+	error = get_domain_sid(domain, &sid);
 	if (error) {
 		pr_info("security_secctx_to_secid %s -> sid: %d, error: %d\n",
 			domain, sid, error);
@@ -109,16 +269,7 @@ static inline u32 current_sid(void)
 
 bool ksu_is_ksu_domain()
 {
-	char *domain;
-	u32 seclen;
-	bool result;
-	int err = security_secid_to_secctx(current_sid(), &domain, &seclen);
-	if (err) {
-		return false;
-	}
-	result = strncmp(KERNEL_SU_DOMAIN, domain, seclen) == 0;
-	security_release_secctx(domain, seclen);
-	return result;
+	return is_sid_match(current_sid(), &ksu_su_sid, KERNEL_SU_DOMAIN);
 }
 
 bool ksu_is_zygote(void *sec)
@@ -127,16 +278,17 @@ bool ksu_is_zygote(void *sec)
 	if (!tsec) {
 		return false;
 	}
-	char *domain;
-	u32 seclen;
-	bool result;
-	int err = security_secid_to_secctx(tsec->sid, &domain, &seclen);
-	if (err) {
-		return false;
-	}
-	result = strncmp("u:r:zygote:s0", domain, seclen) == 0;
-	security_release_secctx(domain, seclen);
-	return result;
+	return is_sid_match(tsec->sid, &ksu_zygote_sid, KERNEL_ZYGOTE_DOMAIN);
+}
+
+bool ksu_is_init_sid(u32 sid)
+{
+	return is_sid_match(sid, &ksu_init_sid, KERNEL_INIT_DOMAIN);
+}
+
+bool ksu_is_su_sid(u32 sid)
+{
+	return is_sid_match(sid, &ksu_su_sid, KERNEL_SU_DOMAIN);
 }
 
 #ifdef CONFIG_KSU_SUSFS
@@ -228,3 +380,7 @@ u32 ksu_get_devpts_sid()
 	}
 	return devpts_sid;
 }
+
+#ifdef CONFIG_KSU_KUNIT_TEST
+#include "selinux_test.c"
+#endif
@@ -18,6 +18,12 @@ bool ksu_is_ksu_domain();
 
 bool ksu_is_zygote(void *cred);
 
+bool ksu_is_init_sid(u32 sid);
+
+bool ksu_is_su_sid(u32 sid);
+
+void ksu_selinux_refresh_sid_cache(void);
+
 void ksu_apply_kernelsu_rules();
 
 #ifdef CONFIG_KSU_SUSFS_SUS_MOUNT
@@ -0,0 +1,85 @@
+/*
+ * KUnit cases for the sid cache, included at the end of selinux.c. they run
+ * at boot before init loads the policy, so the kernel's own initial sid is
+ * used: its context resolves without a policy and takes the string path.
+ */
+#include <kunit/test.h>
+#include <linux/ktime.h>
+
+#define SID_TEST_LOOPS 100000
+
+static char *current_context(struct kunit *test)
+{
+	char *domain, *copy;
+	u32 seclen;
+
+	if (security_secid_to_secctx(current_sid(), &domain, &seclen))
+		return NULL;
+	copy = kunit_kzalloc(test, seclen + 1, GFP_KERNEL);
+	if (copy)
+		memcpy(copy, domain, seclen);
+	security_release_secctx(domain, seclen);
+	return copy;
+}
+
+static void sid_cache_test_reload(struct kunit *test)
+{
+	char *context = current_context(test);
+	u32 sid = current_sid();
+	u32 wrong = sid + 1;
+
+	KUNIT_ASSERT_TRUE(test, context != NULL);
+
+	// a valid cache is trusted, even with a bogus sid in it
+	WRITE_ONCE(sid_cache_seqno, policy_seqno());
+	KUNIT_EXPECT_FALSE(test, is_sid_match(sid, &wrong, context));
+	KUNIT_EXPECT_TRUE(test, is_sid_match(sid, &sid, context));
+
+	// after a reload the context decides, and a refresh is queued
+	WRITE_ONCE(sid_cache_seqno, policy_seqno() + 1);
+	KUNIT_EXPECT_TRUE(test, is_sid_match(sid, &wrong, context));
+	flush_work(&sid_refresh_work);
+	KUNIT_EXPECT_EQ(test, READ_ONCE(sid_cache_seqno), policy_seqno());
+}
+
+// per call cost of the cached compare against the secctx round trip
+static void sid_cache_test_cost(struct kunit *test)
+{
+	char *context = current_context(test);
+	u32 sid = current_sid();
+	u32 none = 0;
+	u64 start, cached_ns, string_ns;
+	int i, hits = 0;
+
+	KUNIT_ASSERT_TRUE(test, context != NULL);
+	WRITE_ONCE(sid_cache_seqno, policy_seqno());
+
+	start = ktime_get_ns();
+	for (i = 0; i < SID_TEST_LOOPS; i++)
+		hits += is_sid_match(sid, &sid, context);
+	cached_ns = ktime_get_ns() - start;
+
+	start = ktime_get_ns();
+	for (i = 0; i < SID_TEST_LOOPS; i++)
+		hits += is_sid_match(sid, &none, context);
+	string_ns = ktime_get_ns() - start;
+
+	KUNIT_EXPECT_EQ(test, hits, 2 * SID_TEST_LOOPS);
+	kunit_info(test, "cached: %llu ns/call, secctx: %llu ns/call\n",
+		   cached_ns / SID_TEST_LOOPS, string_ns / SID_TEST_LOOPS);
+
+	ksu_selinux_refresh_sid_cache();
+}
+
+static struct kunit_case sid_cache_test_cases[] = {
+	KUNIT_CASE(sid_cache_test_reload),
+	KUNIT_CASE(sid_cache_test_cost),
+	{}
+};
+
+static struct kunit_suite sid_cache_test_suite = {
+	.name = "ksu_sid_cache",
+	.test_cases = sid_cache_test_cases,
+};
+
+kunit_test_suite(sid_cache_test_suite);
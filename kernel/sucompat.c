@@ -25,7 +25,7 @@
 
 extern void ksu_escape_to_root();
 
-static bool ksu_sucompat_non_kp __read_mostly = true;
+static KSU_DEFINE_HOOK_KEY(ksu_sucompat_key);
 
 static void __user *userspace_stack_buffer(const void *d, size_t len)
 {
@@ -54,8 +54,7 @@ static char __user *ksud_user_path(void)
 __attribute__((hot, no_stack_protector))
 static __always_inline bool is_su_allowed(const void *ptr_to_check)
 {
-	barrier();
-	if (!ksu_sucompat_non_kp)
+	if (!ksu_hook_key_on(ksu_sucompat_key))
 		return false;
 
 	if (likely(!ksu_is_allow_uid(current_uid().val)))
@@ -67,6 +66,21 @@ static __always_inline bool is_su_allowed(const void *ptr_to_check)
 	return true;
 }
 
+/*
+ * almost every path asked about is not su, and almost none of them starts
+ * with "/system/" either. the first 8 bytes are compared as one word, the
+ * rest of SU_PATH is only read on a match.
+ */
+#define SU_PATH_HEAD_LEN sizeof(u64)
+
+static __always_inline u64 su_path_head(void)
+{
+	u64 head;
+
+	memcpy(&head, SU_PATH, SU_PATH_HEAD_LEN); // folded into a constant
+	return head;
+}
+
 static int ksu_sucompat_user_common(const char __user **filename_user,
 				const char *syscall_name,
 				const bool escalate)
@@ -74,7 +88,18 @@ static int ksu_sucompat_user_common(const char __user **filename_user,
 	const char su[] = SU_PATH;
 
 	char path[sizeof(su)]; // sizeof includes nullterm already!
-	if (ksu_copy_from_user_retry(path, *filename_user, sizeof(path)))
+	u64 head;
+
+	if (ksu_copy_from_user_retry(&head, *filename_user, sizeof(head)))
+		return 0;
+
+	if (likely(head != su_path_head()))
+		return 0;
+
+	memcpy(path, &head, sizeof(head));
+	if (ksu_copy_from_user_retry(path + SU_PATH_HEAD_LEN,
+				     *filename_user + SU_PATH_HEAD_LEN,
+				     sizeof(path) - SU_PATH_HEAD_LEN))
 		return 0;
 
 	path[sizeof(path) - 1] = '\0';
@@ -138,8 +163,14 @@ int ksu_getname_flags_user(const char __user **filename_user, int flags)
 
 static int ksu_sucompat_kernel_common(void *filename_ptr, const char *function_name, bool escalate)
 {
+	u64 head;
 
-	if (likely(memcmp(filename_ptr, SU_PATH, sizeof(SU_PATH))))
+	memcpy(&head, filename_ptr, sizeof(head));
+	if (likely(head != su_path_head()))
+		return 0;
+
+	if (memcmp(filename_ptr + SU_PATH_HEAD_LEN, SU_PATH + SU_PATH_HEAD_LEN,
+		   sizeof(SU_PATH) - SU_PATH_HEAD_LEN))
 		return 0;
 
 	if (escalate) {
@@ -208,8 +239,7 @@ int ksu_handle_devpts(struct inode *inode)
 
 int __ksu_handle_devpts(struct inode *inode)
 {
-	barrier();
-	if (!ksu_sucompat_non_kp)
+	if (!ksu_hook_key_on(ksu_sucompat_key))
 		return 0;
 
 	if (!current->mm) {
@@ -239,12 +269,16 @@ int __ksu_handle_devpts(struct inode *inode)
 // sucompat: permited process can execute 'su' to gain root access.
 void ksu_sucompat_init()
 {
-	ksu_sucompat_non_kp = true;
+	ksu_hook_key_enable(ksu_sucompat_key);
 	pr_info("ksu_sucompat_init: hooks enabled: execve/execveat_su, faccessat, stat, devpts\n");
 }
 
 void ksu_sucompat_exit()
 {
-	ksu_sucompat_non_kp = false;
+	ksu_hook_key_disable(ksu_sucompat_key);
 	pr_info("ksu_sucompat_exit: hooks disabled: execve/execveat_su, faccessat, stat, devpts\n");
 }
+
+#ifdef CONFIG_KSU_KUNIT_TEST
+#include "sucompat_test.c"
+#endif
@@ -0,0 +1,113 @@
+/*
+ * KUnit cases for the su path matcher, included at the end of sucompat.c.
+ * the kernel side matcher is fed without escalation, a match only turns the
+ * path into SH_PATH. the user side shares su_path_head() with it.
+ */
+#include <kunit/test.h>
+#include <linux/ktime.h>
+
+#define SU_TEST_BUF 32
+#define SU_TEST_LOOPS 100000
+
+// copies path to buf + offset and reports whether it was rewritten to SH_PATH
+static bool su_test_match(char *buf, int offset, const char *path)
+{
+	char *p = buf + offset;
+
+	// struct filename keeps the name in a larger buffer, the tail is readable
+	memset(buf, 0, SU_TEST_BUF);
+	strscpy(p, path, SU_TEST_BUF - offset);
+	ksu_sucompat_kernel_common(p, "kunit", false);
+	return strcmp(p, path) && !strcmp(p, SH_PATH);
+}
+
+static void sucompat_test_head(struct kunit *test)
+{
+	char head[SU_PATH_HEAD_LEN];
+	u64 word = su_path_head();
+
+	memcpy(head, &word, sizeof(head));
+	KUNIT_EXPECT_EQ(test, memcmp(head, "/system/", SU_PATH_HEAD_LEN), 0);
+}
+
+static void sucompat_test_paths(struct kunit *test)
+{
+	static const char *const misses[] = {
+		"",
+		"/",
+		"/sys",
+		"/system",
+		"/system/", // the head alone
+		"/system/bin",
+		"/system/bin/s",
+		"/system/bin/sh",
+		"/system/bin/su2",
+		"/system/xbin/su",
+		"/System/bin/su",
+		"/data/local/tmp/su",
+		"/storage/emulated/0/DCIM/Camera",
+	};
+	char *buf = kunit_kzalloc(test, SU_TEST_BUF, GFP_KERNEL);
+	int offset, i;
+
+	KUNIT_ASSERT_TRUE(test, buf != NULL);
+
+	// every alignment of the head word
+	for (offset = 0; offset < SU_PATH_HEAD_LEN; offset++) {
+		KUNIT_EXPECT_TRUE(test, su_test_match(buf, offset, SU_PATH));
+		for (i = 0; i < ARRAY_SIZE(misses); i++)
+			KUNIT_EXPECT_FALSE(test,
+					   su_test_match(buf, offset, misses[i]));
+	}
+}
+
+// a stat storm of a file manager: mostly other heads, some under /system/
+static void sucompat_test_cost(struct kunit *test)
+{
+	static const char *const paths[] = {
+		"/storage/emulated/0/DCIM/Camera/IMG_0001.jpg",
+		"/data/user/0/com.android.documentsui/cache",
+		"/system/lib64/libc.so",
+		"/sdcard/Download/archive.zip",
+	};
+	char *buf = kunit_kzalloc(test, 64 * ARRAY_SIZE(paths), GFP_KERNEL);
+	u64 start, head_ns, full_ns;
+	int i, full = 0;
+
+	KUNIT_ASSERT_TRUE(test, buf != NULL);
+	for (i = 0; i < ARRAY_SIZE(paths); i++)
+		strscpy(buf + 64 * i, paths[i], 64);
+
+	start = ktime_get_ns();
+	for (i = 0; i < SU_TEST_LOOPS; i++)
+		ksu_sucompat_kernel_common(buf + 64 * (i % ARRAY_SIZE(paths)),
+					   "kunit", false);
+	head_ns = ktime_get_ns() - start;
+
+	// what every path paid before: the whole SU_PATH compared
+	start = ktime_get_ns();
+	for (i = 0; i < SU_TEST_LOOPS; i++)
+		full += !memcmp(buf + 64 * (i % ARRAY_SIZE(paths)), SU_PATH,
+				sizeof(SU_PATH));
+	full_ns = ktime_get_ns() - start;
+
+	KUNIT_EXPECT_EQ(test, full, 0);
+	for (i = 0; i < ARRAY_SIZE(paths); i++)
+		KUNIT_EXPECT_STREQ(test, buf + 64 * i, paths[i]);
+	kunit_info(test, "head word: %llu ns/path, full compare: %llu ns/path\n",
+		   head_ns / SU_TEST_LOOPS, full_ns / SU_TEST_LOOPS);
+}
+
+static struct kunit_case sucompat_test_cases[] = {
+	KUNIT_CASE(sucompat_test_head),
+	KUNIT_CASE(sucompat_test_paths),
+	KUNIT_CASE(sucompat_test_cost),
+	{}
+};
+
+static struct kunit_suite sucompat_test_suite = {
+	.name = "ksu_sucompat",
+	.test_cases = sucompat_test_cases,
+};
+
+kunit_test_suite(sucompat_test_suite);
@@ -1,32 +1,149 @@
+#include <linux/atomic.h>
+#include <linux/completion.h>
+#include <linux/delay.h>
 #include <linux/err.h>
 #include <linux/fs.h>
+#include <linux/hash.h>
 #include <linux/list.h>
+#include <linux/moduleparam.h>
+#include <linux/mutex.h>
+#include <linux/pid.h>
 #include <linux/slab.h>
 #include <linux/string.h>
 #include <linux/types.h>
+#include <linux/uaccess.h>
 #include <linux/version.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
 
 #include "allowlist.h"
+#include "apk_sign.h"
 #include "klog.h" // IWYU pragma: keep
 #include "ksu.h"
 #include "manager.h"
 #include "throne_tracker.h"
 #include "kernel_compat.h"
 
-#include <linux/kthread.h>
 #include <linux/sched.h>
 
 uid_t ksu_manager_uid = KSU_INVALID_UID;
 
-static struct task_struct *throne_thread;
 #define SYSTEM_PACKAGES_LIST_PATH "/data/system/packages.list"
 
+/*
+ * packages.list as a set of (package, uid), hashed by package name.
+ * entries come from their own slab cache, the set only lives during one
+ * run of the tracker.
+ */
+#define PACKAGES_HASH_BITS 8
+
 struct uid_data {
 	struct list_head list;
+	struct list_head hash_list;
 	u32 uid;
 	char package[KSU_MAX_PACKAGE_NAME];
 };
 
+struct uid_set {
+	struct list_head all;
+	struct list_head buckets[1 << PACKAGES_HASH_BITS];
+};
+
+/*
+ * dedicated caches for the nodes of a tracker run, all allocated in process
+ * context with GFP_KERNEL. live object counts are under
+ * /sys/module/kernelsu/parameters.
+ */
+static struct kmem_cache *uid_data_cachep = NULL;
+static struct kmem_cache *data_path_cachep = NULL;
+static struct kmem_cache *apk_verdict_cachep = NULL;
+
+static unsigned int uid_data_live = 0;
+module_param_named(throne_uid_data_live, uid_data_live, uint, 0444);
+static unsigned int data_path_live = 0;
+module_param_named(throne_data_path_live, data_path_live, uint, 0444);
+
+static inline unsigned int ksu_full_name_hash(const char *name, unsigned int len)
+{
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 8, 0)
+	return full_name_hash(name, len);
+#else
+	return full_name_hash(NULL, name, len);
+#endif
+}
+
+static inline struct list_head *package_bucket(struct uid_set *set,
+					       const char *package)
+{
+	unsigned int hash = ksu_full_name_hash(package, strlen(package));
+	return &set->buckets[hash_32(hash, PACKAGES_HASH_BITS)];
+}
+
+static void uid_set_init(struct uid_set *set)
+{
+	int i;
+
+	INIT_LIST_HEAD(&set->all);
+	for (i = 0; i < ARRAY_SIZE(set->buckets); i++)
+		INIT_LIST_HEAD(&set->buckets[i]);
+}
+
+static bool uid_set_add(struct uid_set *set, const char *package, u32 uid)
+{
+	struct uid_data *data;
+
+	if (!uid_data_cachep)
+		return false;
+
+	data = kmem_cache_alloc(uid_data_cachep, GFP_KERNEL);
+	if (!data)
+		return false;
+	uid_data_live++;
+
+	data->uid = uid;
+	strncpy(data->package, package, KSU_MAX_PACKAGE_NAME - 1);
+	data->package[KSU_MAX_PACKAGE_NAME - 1] = '\0';
+	list_add_tail(&data->list, &set->all);
+	list_add_tail(&data->hash_list, package_bucket(set, data->package));
+	return true;
+}
+
+static struct uid_data *uid_set_find(struct uid_set *set, const char *package)
+{
+	struct uid_data *np;
+
+	list_for_each_entry (np, package_bucket(set, package), hash_list) {
+		if (strncmp(np->package, package, KSU_MAX_PACKAGE_NAME) == 0)
+			return np;
+	}
+	return NULL;
+}
+
+static void uid_set_destroy(struct uid_set *set)
+{
+	struct uid_data *np, *n;
+
+	list_for_each_entry_safe (np, n, &set->all, list) {
+		list_del(&np->list);
+		kmem_cache_free(uid_data_cachep, np);
+		uid_data_live--;
+	}
+	uid_set_init(set);
+}
+
+/*
+ * the rename hook runs before the rename itself, remember the inode that is
+ * about to become packages.list and wait until the path resolves to it.
+ */
+static unsigned long renamed_packages_ino = 0;
+static unsigned long renamed_packages_at = 0; // jiffies
+
+// latency stats, in ms
+static unsigned int throne_wait_ms = 0;
+module_param_named(throne_wait_ms, throne_wait_ms, uint, 0444);
+static unsigned int throne_crown_latency_ms = 0;
+module_param_named(throne_crown_latency_ms, throne_crown_latency_ms, uint, 0444);
+
 static int get_pkg_from_apk_path(char *pkg, const char *path)
 {
 	int len = strlen(path);
@@ -66,7 +183,7 @@ static int get_pkg_from_apk_path(char *pkg, const char *path)
 	return 0;
 }
 
-static void crown_manager(const char *apk, struct list_head *uid_data)
+static void crown_manager(const char *apk, struct uid_set *uid_data)
 {
 	char pkg[KSU_MAX_PACKAGE_NAME];
 	if (get_pkg_from_apk_path(pkg, apk) < 0) {
@@ -84,41 +201,362 @@ static void crown_manager(const char *apk, struct list_head *uid_data)
 		return;
 	}
 #endif
-	struct list_head *list = (struct list_head *)uid_data;
-	struct uid_data *np;
+	struct uid_data *np = uid_set_find(uid_data, pkg);
 
-	list_for_each_entry (np, list, list) {
-		if (strncmp(np->package, pkg, KSU_MAX_PACKAGE_NAME) == 0) {
-			pr_info("Crowning manager: %s(uid=%d)\n", pkg, np->uid);
-			ksu_set_manager_uid(np->uid);
-			break;
-		}
+	if (np) {
+		unsigned long renamed_at = READ_ONCE(renamed_packages_at);
+
+		pr_info("Crowning manager: %s(uid=%d)\n", pkg, np->uid);
+		ksu_set_manager_uid(np->uid);
+		if (renamed_at)
+			throne_crown_latency_ms = jiffies_to_msecs(jiffies - renamed_at);
 	}
 }
 
 #define DATA_PATH_LEN 384 // 384 is enough for /data/app/<package>/base.apk
 
+struct manager_scan;
+
 struct data_path {
 	char dirpath[DATA_PATH_LEN];
 	int depth;
 	struct list_head list;
+	struct work_struct work;
+	struct manager_scan *scan;
 };
 
-struct apk_path_hash {
-	unsigned int hash;
-	bool exists;
+/*
+ * "not a manager" verdicts of base.apk files, keyed by inode identity instead
+ * of path: an update or a reboot moves the apk to a new /data/app/~~xxx==
+ * directory but an unchanged file keeps its inode. kept across tracker runs,
+ * and across boots in APK_VERDICT_FILE. loaded, dropped and saved under
+ * throne_mutex, the scan workers of a search (which runs under throne_mutex)
+ * look up and add verdicts concurrently under scan->lock.
+ * a verdict only holds for the trusted certs it was made against, all of them
+ * are dropped once ksu_trusted_certs_fingerprint() changes.
+ */
+#define APK_VERDICT_DIR "/data/adb/ksu"
+#define APK_VERDICT_NAME ".apk_verdicts"
+#define APK_VERDICT_TMP_NAME ".apk_verdicts.tmp"
+#define APK_VERDICT_FILE APK_VERDICT_DIR "/" APK_VERDICT_NAME
+#define APK_VERDICT_TMP APK_VERDICT_DIR "/" APK_VERDICT_TMP_NAME
+#define APK_VERDICT_MAGIC 0x4b534156 // 'KSAV'
+#define APK_VERDICT_VERSION 2
+#define APK_VERDICT_HASH_BITS 8
+#define APK_VERDICT_MAX 4096
+
+struct apk_identity {
+	u64 ino;
+	s64 size;
+	s64 mtime_sec;
+	u32 mtime_nsec;
+	u32 dev;
+	u32 generation;
+	u32 reserved;
+};
+
+struct apk_verdict {
 	struct list_head list;
+	struct apk_identity id;
+	bool seen;
 };
 
-static struct list_head apk_path_hash_list = LIST_HEAD_INIT(apk_path_hash_list);
+static struct list_head apk_verdicts[1 << APK_VERDICT_HASH_BITS];
+static unsigned int apk_verdict_count = 0;
+module_param_named(apk_verdicts_live, apk_verdict_count, uint, 0444);
+static bool apk_verdicts_loaded = false;
+static bool apk_verdicts_dirty = false;
+static u32 apk_verdicts_fingerprint = 0;
+
+static unsigned int apk_verdict_hits = 0;
+module_param_named(apk_verdict_hits, apk_verdict_hits, uint, 0444);
+static unsigned int apk_verdict_misses = 0;
+module_param_named(apk_verdict_misses, apk_verdict_misses, uint, 0444);
+static bool apk_verdict_persist = true;
+module_param_named(apk_verdict_persist, apk_verdict_persist, bool, 0644);
+
+static int apk_identity_get(const char *path, struct apk_identity *id)
+{
+	struct path kpath;
+	struct inode *inode;
+	int err;
+
+	err = kern_path(path, 0, &kpath);
+	if (err)
+		return err;
+
+	inode = kpath.dentry->d_inode;
+	if (!inode) {
+		path_put(&kpath);
+		return -ENOENT;
+	}
+
+	memset(id, 0, sizeof(*id));
+	id->ino = inode->i_ino;
+	id->dev = inode->i_sb->s_dev;
+	id->generation = inode->i_generation;
+	id->size = i_size_read(inode);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+	id->mtime_sec = inode_get_mtime(inode).tv_sec;
+	id->mtime_nsec = inode_get_mtime(inode).tv_nsec;
+#else
+	id->mtime_sec = inode->i_mtime.tv_sec;
+	id->mtime_nsec = inode->i_mtime.tv_nsec;
+#endif
+	path_put(&kpath);
+	return 0;
+}
+
+static inline struct list_head *apk_verdict_bucket(const struct apk_identity *id)
+{
+	return &apk_verdicts[hash_32((u32)id->ino ^ id->generation,
+				     APK_VERDICT_HASH_BITS)];
+}
+
+static struct apk_verdict *apk_verdict_find(const struct apk_identity *id)
+{
+	struct apk_verdict *v;
+
+	list_for_each_entry (v, apk_verdict_bucket(id), list) {
+		if (!memcmp(&v->id, id, sizeof(*id)))
+			return v;
+	}
+	return NULL;
+}
+
+static void apk_verdict_add(const struct apk_identity *id)
+{
+	struct apk_verdict *v;
+
+	if (!apk_verdict_cachep || apk_verdict_count >= APK_VERDICT_MAX)
+		return;
+
+	v = kmem_cache_alloc(apk_verdict_cachep, GFP_KERNEL);
+	if (!v)
+		return;
+
+	v->id = *id;
+	v->seen = true;
+	list_add_tail(&v->list, apk_verdict_bucket(id));
+	apk_verdict_count++;
+	apk_verdicts_dirty = true;
+}
+
+static void apk_verdicts_drop(bool unseen_only)
+{
+	struct apk_verdict *v, *n;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(apk_verdicts); i++) {
+		list_for_each_entry_safe (v, n, &apk_verdicts[i], list) {
+			if (unseen_only && v->seen)
+				continue;
+			list_del(&v->list);
+			kmem_cache_free(apk_verdict_cachep, v);
+			apk_verdict_count--;
+			apk_verdicts_dirty = true;
+		}
+	}
+}
+
+static void apk_verdicts_load()
+{
+	struct apk_identity id;
+	struct file *fp;
+	loff_t off = 0;
+	u32 header[4];
+	u32 i;
+
+	apk_verdicts_loaded = true;
+	apk_verdicts_fingerprint = ksu_trusted_certs_fingerprint();
+	if (!apk_verdict_persist)
+		return;
+
+	fp = ksu_filp_open_compat(APK_VERDICT_FILE, O_RDONLY, 0);
+	if (IS_ERR(fp))
+		return;
+
+	if (ksu_kernel_read_compat(fp, header, sizeof(header), &off) !=
+		    sizeof(header) ||
+	    header[0] != APK_VERDICT_MAGIC || header[1] != APK_VERDICT_VERSION ||
+	    header[3] != apk_verdicts_fingerprint) {
+		pr_info("%s: ignore stale " APK_VERDICT_FILE "\n", __func__);
+		goto out;
+	}
+
+	for (i = 0; i < header[2] && i < APK_VERDICT_MAX; i++) {
+		if (ksu_kernel_read_compat(fp, &id, sizeof(id), &off) != sizeof(id))
+			break;
+		if (!apk_verdict_find(&id))
+			apk_verdict_add(&id);
+	}
+	pr_info("%s: loaded %u apk verdicts\n", __func__, apk_verdict_count);
+out:
+	filp_close(fp, 0);
+	apk_verdicts_dirty = false;
+}
+
+static void apk_verdicts_save()
+{
+	struct apk_verdict *v;
+	struct file *fp;
+	loff_t off = 0;
+	u32 header[4] = { APK_VERDICT_MAGIC, APK_VERDICT_VERSION,
+			  apk_verdict_count, apk_verdicts_fingerprint };
+	bool ok = false;
+	int err, i;
+
+	if (!apk_verdict_persist || !apk_verdicts_dirty)
+		return;
+
+	// written aside and renamed over, a crash never leaves a half file
+	fp = ksu_filp_open_compat(APK_VERDICT_TMP, O_WRONLY | O_CREAT | O_TRUNC,
+				  0600);
+	if (IS_ERR(fp)) {
+		pr_err("%s: open " APK_VERDICT_TMP " failed: %ld\n", __func__,
+		       PTR_ERR(fp));
+		return;
+	}
+
+	if (ksu_kernel_write_compat(fp, header, sizeof(header), &off) !=
+	    sizeof(header))
+		goto out;
+
+	for (i = 0; i < ARRAY_SIZE(apk_verdicts); i++) {
+		list_for_each_entry (v, &apk_verdicts[i], list) {
+			if (ksu_kernel_write_compat(fp, &v->id, sizeof(v->id),
+						    &off) != sizeof(v->id))
+				goto out;
+		}
+	}
+	ok = !vfs_fsync(fp, 0);
+out:
+	filp_close(fp, 0);
+	if (!ok) {
+		pr_err("%s: write " APK_VERDICT_TMP " failed\n", __func__);
+		return;
+	}
+
+	err = ksu_rename_compat(APK_VERDICT_DIR, APK_VERDICT_TMP_NAME,
+				APK_VERDICT_NAME);
+	if (err) {
+		pr_err("%s: rename " APK_VERDICT_TMP " failed: %d\n", __func__,
+		       err);
+		return;
+	}
+	apk_verdicts_dirty = false;
+}
+
+/*
+ * manager candidates: the package name in /data/app/~~xxx==/<pkg>-yyy==/ is
+ * checked against them before the apk is touched. a search only looks at
+ * candidates first and scans every apk only if none of them is the manager.
+ * only used under throne_mutex.
+ */
+#define MAX_MANAGER_CANDIDATES 8
+
+static char manager_candidates[256] = "me.weishu.kernelsu";
+module_param_string(manager_candidates, manager_candidates,
+		    sizeof(manager_candidates), 0644);
+static bool manager_prefilter = true;
+module_param_named(manager_prefilter, manager_prefilter, bool, 0644);
+
+// last search, per pass
+static unsigned int manager_scan_prefilter_ms = 0;
+module_param_named(manager_scan_prefilter_ms, manager_scan_prefilter_ms, uint, 0444);
+static unsigned int manager_scan_prefilter_opened = 0;
+module_param_named(manager_scan_prefilter_opened, manager_scan_prefilter_opened, uint, 0444);
+static unsigned int manager_scan_full_ms = 0;
+module_param_named(manager_scan_full_ms, manager_scan_full_ms, uint, 0444);
+static unsigned int manager_scan_full_opened = 0;
+module_param_named(manager_scan_full_opened, manager_scan_full_opened, uint, 0444);
+
+static char candidate_buf[sizeof(manager_candidates)];
+static const char *candidate_names[MAX_MANAGER_CANDIDATES];
+static unsigned int candidate_hashes[MAX_MANAGER_CANDIDATES];
+static int candidate_count = 0;
+
+static void add_manager_candidate(const char *name)
+{
+	if (!*name || candidate_count >= MAX_MANAGER_CANDIDATES)
+		return;
+
+	candidate_names[candidate_count] = name;
+	candidate_hashes[candidate_count] = ksu_full_name_hash(name, strlen(name));
+	candidate_count++;
+}
+
+// parse the candidates again, the param may have changed, false if none
+static bool load_manager_candidates()
+{
+	char *cur = candidate_buf;
+	char *name;
+
+	candidate_count = 0;
+#ifdef KSU_MANAGER_PACKAGE
+	add_manager_candidate(KSU_MANAGER_PACKAGE);
+#endif
+
+	memcpy(candidate_buf, manager_candidates, sizeof(candidate_buf));
+	candidate_buf[sizeof(candidate_buf) - 1] = '\0';
+	while ((name = strsep(&cur, ",")))
+		add_manager_candidate(strim(name));
+
+	return candidate_count > 0;
+}
+
+static bool is_manager_candidate(const char *pkg)
+{
+	unsigned int hash = ksu_full_name_hash(pkg, strlen(pkg));
+	int i;
+
+	for (i = 0; i < candidate_count; i++) {
+		if (candidate_hashes[i] == hash && !strcmp(candidate_names[i], pkg))
+			return true;
+	}
+	return false;
+}
+
+/*
+ * one search over /data/app. every directory is its own work item on
+ * ksu_scan_wq, at most manager_scan_workers of them run at once. a search
+ * always runs to the end and verifies every manager apk it meets, the
+ * smallest verified path wins. so the result doesn't depend on the order the
+ * workers ran in, the verdict cache keeps the extra verifications cheap.
+ */
+struct manager_scan;
+struct my_dir_context;
+
+// how a search lists a directory and checks an apk
+struct manager_scan_ops {
+	void (*iterate)(struct manager_scan *scan, struct data_path *pos,
+			struct my_dir_context *ctx);
+	enum ksu_apk_check (*check)(char *path);
+};
+
+struct manager_scan {
+	const struct manager_scan_ops *ops;
+	bool prefilter; // only open apks of a candidate package
+	unsigned long magic; // of /data/app, set before any subdirectory is queued
+	atomic_t pending;
+	struct completion done;
+	struct list_head serial; // directories to walk when there is no ksu_scan_wq
+	struct mutex lock; // verdicts, opened, manager, data_path_live
+	unsigned int opened;
+	char manager[DATA_PATH_LEN];
+};
+
+static struct workqueue_struct *ksu_scan_wq = NULL;
+static unsigned int manager_scan_workers = 4;
+module_param_named(manager_scan_workers, manager_scan_workers, uint, 0444);
+
+static void scan_queue_dir(struct manager_scan *scan, struct data_path *data);
 
 struct my_dir_context {
 	struct dir_context ctx;
-	struct list_head *data_path_list;
 	char *parent_dir;
-	void *private_data;
 	int depth;
-	int *stop;
+	struct manager_scan *scan;
 };
 // https://docs.kernel.org/filesystems/porting.html
 // filldir_t (readdir callbacks) calling conventions have changed. Instead of returning 0 or -E... it returns bool now. false means "no more" (as -E... used to) and true - "keep going" (as 0 in old calling conventions). Rationale: callers never looked at specific -E... values anyway. -> iterate_shared() instances require no changes at all, all filldir_t ones in the tree converted.
@@ -148,16 +586,14 @@ FILLDIR_RETURN_TYPE my_actor(MY_ACTOR_CTX_ARG, const char *name,
 #endif
 	struct my_dir_context *my_ctx =
 		container_of(ctx, struct my_dir_context, ctx);
+	struct manager_scan *scan;
 	char dirpath[DATA_PATH_LEN];
 
 	if (!my_ctx) {
 		pr_err("Invalid context\n");
 		return FILLDIR_ACTOR_STOP;
 	}
-	if (my_ctx->stop && *my_ctx->stop) {
-		pr_info("Stop searching\n");
-		return FILLDIR_ACTOR_STOP;
-	}
+	scan = my_ctx->scan;
 
 	if (!strncmp(name, "..", namelen) || !strncmp(name, ".", namelen))
 		return FILLDIR_ACTOR_CONTINUE; // Skip "." and ".."
@@ -175,9 +611,9 @@ FILLDIR_RETURN_TYPE my_actor(MY_ACTOR_CTX_ARG, const char *name,
 		return FILLDIR_ACTOR_CONTINUE;
 	}
 
-	if (d_type == DT_DIR && my_ctx->depth > 0 &&
-	    (my_ctx->stop && !*my_ctx->stop)) {
-		struct data_path *data = kmalloc(sizeof(struct data_path), GFP_ATOMIC);
+	if (d_type == DT_DIR && my_ctx->depth > 0) {
+		struct data_path *data = data_path_cachep ?
+			kmem_cache_alloc(data_path_cachep, GFP_KERNEL) : NULL;
 
 		if (!data) {
 			pr_err("Failed to allocate memory for %s\n", dirpath);
@@ -190,40 +626,48 @@ FILLDIR_RETURN_TYPE my_actor(MY_ACTOR_CTX_ARG, const char *name,
 		strscpy(data->dirpath, dirpath, DATA_PATH_LEN);
 #endif
 		data->depth = my_ctx->depth - 1;
-		list_add_tail(&data->list, my_ctx->data_path_list);
+		scan_queue_dir(scan, data);
 	} else {
 		if ((namelen == 8) && (strncmp(name, "base.apk", namelen) == 0)) {
-			struct apk_path_hash *pos, *n;
-#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 8, 0)
-			unsigned int hash = full_name_hash(dirpath, strlen(dirpath));
-#else
-			unsigned int hash = full_name_hash(NULL, dirpath, strlen(dirpath));
-#endif
-			list_for_each_entry(pos, &apk_path_hash_list, list) {
-				if (hash == pos->hash) {
-					pos->exists = true;
+			if (scan->prefilter) {
+				char pkg[KSU_MAX_PACKAGE_NAME];
+				if (get_pkg_from_apk_path(pkg, dirpath) < 0 ||
+				    !is_manager_candidate(pkg))
+					return FILLDIR_ACTOR_CONTINUE;
+			}
+
+			struct apk_identity id;
+			bool has_id = !apk_identity_get(dirpath, &id);
+
+			mutex_lock(&scan->lock);
+			if (has_id) {
+				struct apk_verdict *v = apk_verdict_find(&id);
+				if (v) {
+					v->seen = true;
+					apk_verdict_hits++;
+					mutex_unlock(&scan->lock);
 					return FILLDIR_ACTOR_CONTINUE;
 				}
+				apk_verdict_misses++;
 			}
+			scan->opened++;
+			mutex_unlock(&scan->lock);
 
-			bool is_manager = ksu_is_manager_apk(dirpath);
+			enum ksu_apk_check check = scan->ops->check(dirpath);
+			bool is_manager = check == KSU_APK_MANAGER;
 			pr_info("Found new base.apk at path: %s, is_manager: %d\n",
 				dirpath, is_manager);
-			if (is_manager) {
-				crown_manager(dirpath, my_ctx->private_data);
-				*my_ctx->stop = 1;
 
-				// Manager found, clear APK cache list
-				list_for_each_entry_safe(pos, n, &apk_path_hash_list, list) {
-					list_del(&pos->list);
-					kfree(pos);
-				}
-			} else {
-				struct apk_path_hash *apk_data = kmalloc(sizeof(struct apk_path_hash), GFP_ATOMIC);
-				apk_data->hash = hash;
-				apk_data->exists = true;
-				list_add_tail(&apk_data->list, &apk_path_hash_list);
+			mutex_lock(&scan->lock);
+			if (is_manager) {
+				if (!scan->manager[0] ||
+				    strcmp(dirpath, scan->manager) < 0)
+					strcpy(scan->manager, dirpath);
+			} else if (has_id && check == KSU_APK_NOT_MANAGER) {
+				// a busy or vanished apk is simply checked again
+				apk_verdict_add(&id);
 			}
+			mutex_unlock(&scan->lock);
 		}
 	}
 
@@ -263,6 +707,57 @@ bool is_lock_held(const char *path)
 	return false;
 }
 
+/*
+ * retry with a short exponential backoff instead of a fixed 100ms, a rename
+ * or an install usually settles within a few ms.
+ * false once KSU_WAIT_BUDGET_MS is used up.
+ */
+#define KSU_WAIT_MIN_US 500
+#define KSU_WAIT_MAX_US 8000
+#define KSU_WAIT_BUDGET_MS 1000
+
+bool ksu_wait_backoff(unsigned int *delay_us, unsigned int *waited_us)
+{
+	if (*waited_us >= KSU_WAIT_BUDGET_MS * 1000)
+		return false;
+
+	*delay_us = *delay_us ? min(*delay_us * 2, KSU_WAIT_MAX_US) : KSU_WAIT_MIN_US;
+	usleep_range(*delay_us, *delay_us + *delay_us / 4);
+	*waited_us += *delay_us;
+	return true;
+}
+
+void ksu_throne_note_rename(struct dentry *renamed)
+{
+	if (!renamed || !renamed->d_inode)
+		return;
+
+	WRITE_ONCE(renamed_packages_at, jiffies);
+	WRITE_ONCE(renamed_packages_ino, renamed->d_inode->i_ino);
+}
+
+/*
+ * with wait_rename, packages.list has to be the inode the rename hook saw.
+ * that rename only happens after the hook returns, so a run from inside the
+ * hook must not wait for it.
+ */
+static bool packages_list_settled(bool wait_rename)
+{
+	unsigned long ino = READ_ONCE(renamed_packages_ino);
+	struct path kpath;
+	bool settled;
+
+	if (!wait_rename || !ino)
+		return !is_lock_held(SYSTEM_PACKAGES_LIST_PATH);
+
+	if (kern_path(SYSTEM_PACKAGES_LIST_PATH, 0, &kpath))
+		return false;
+
+	settled = kpath.dentry->d_inode && kpath.dentry->d_inode->i_ino == ino;
+	path_put(&kpath);
+	return settled;
+}
+
 // compat: https://elixir.bootlin.com/linux/v3.9/source/include/linux/fs.h#L771
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3,9,0)
 #define S_MAGIC_COMPAT(x) ((x)->f_inode->i_sb->s_magic)
@@ -270,177 +765,284 @@ bool is_lock_held(const char *path)
 #define S_MAGIC_COMPAT(x) ((x)->f_path.dentry->d_inode->i_sb->s_magic)
 #endif
 
-void search_manager(const char *path, int depth, struct list_head *uid_data)
+static void iterate_data_dir(struct manager_scan *scan, struct data_path *pos,
+			     struct my_dir_context *ctx)
 {
-	int i, stop = 0;
-	struct list_head data_path_list;
-	INIT_LIST_HEAD(&data_path_list);
-	unsigned long data_app_magic = 0;
-	
-	// Initialize APK cache list
-	struct apk_path_hash *pos, *n;
-	list_for_each_entry(pos, &apk_path_hash_list, list) {
-		pos->exists = false;
+	struct file *file;
+
+	file = ksu_filp_open_compat(pos->dirpath, O_RDONLY | O_NOFOLLOW | O_DIRECTORY, 0);
+	if (IS_ERR(file)) {
+		pr_err("Failed to open directory: %s, err: %ld\n", pos->dirpath, PTR_ERR(file));
+		return;
+	}
+
+	// grab magic on first folder, which is /data/app
+	if (!scan->magic) {
+		if (S_MAGIC_COMPAT(file)) {
+			scan->magic = S_MAGIC_COMPAT(file);
+			pr_info("%s: dir: %s got magic! 0x%lx\n", __func__, pos->dirpath, scan->magic);
+		} else {
+			filp_close(file, NULL);
+			return;
+		}
+	}
+
+	if (S_MAGIC_COMPAT(file) != scan->magic) {
+		pr_info("%s: skip: %s magic: 0x%lx expected: 0x%lx\n", __func__, pos->dirpath, 
+			S_MAGIC_COMPAT(file), scan->magic);
+		filp_close(file, NULL);
+		return;
 	}
 
+	iterate_dir(file, &ctx->ctx);
+	filp_close(file, NULL);
+}
+
+static const struct manager_scan_ops data_app_scan_ops = {
+	.iterate = iterate_data_dir,
+	.check = ksu_check_manager_apk,
+};
+
+static void scan_dir(struct manager_scan *scan, struct data_path *pos)
+{
+	struct my_dir_context ctx = { .ctx.actor = my_actor,
+				      .parent_dir = pos->dirpath,
+				      .depth = pos->depth,
+				      .scan = scan };
+
+	scan->ops->iterate(scan, pos, &ctx);
+
+	kmem_cache_free(data_path_cachep, pos);
+	mutex_lock(&scan->lock);
+	data_path_live--;
+	mutex_unlock(&scan->lock);
+
+	if (atomic_dec_and_test(&scan->pending))
+		complete(&scan->done);
+}
+
+static void scan_dir_work(struct work_struct *work)
+{
+	struct data_path *data = container_of(work, struct data_path, work);
+
+	scan_dir(data->scan, data);
+}
+
+// takes the ownership of data
+static void scan_queue_dir(struct manager_scan *scan, struct data_path *data)
+{
+	mutex_lock(&scan->lock);
+	data_path_live++;
+	mutex_unlock(&scan->lock);
+
+	data->scan = scan;
+	atomic_inc(&scan->pending);
+	if (ksu_scan_wq) {
+		INIT_WORK(&data->work, scan_dir_work);
+		queue_work(ksu_scan_wq, &data->work);
+	} else {
+		// the caller walks the list, directory by directory
+		list_add_tail(&data->list, &scan->serial);
+	}
+}
+
+// the smallest verified manager path ends up in manager, false if none
+static bool walk_data_app(const char *path, int depth,
+			  const struct manager_scan_ops *ops, bool prefilter,
+			  char *manager, unsigned int *opened)
+{
+	struct manager_scan *scan;
+	struct data_path *data;
+	bool found;
+
+	scan = kzalloc(sizeof(*scan), GFP_KERNEL);
+	data = data_path_cachep ? kmem_cache_alloc(data_path_cachep, GFP_KERNEL) : NULL;
+	if (!scan || !data) {
+		pr_err("%s: alloc failed\n", __func__);
+		kfree(scan);
+		if (data)
+			kmem_cache_free(data_path_cachep, data);
+		return false;
+	}
+
+	scan->ops = ops;
+	scan->prefilter = prefilter;
+	atomic_set(&scan->pending, 0);
+	init_completion(&scan->done);
+	INIT_LIST_HEAD(&scan->serial);
+	mutex_init(&scan->lock);
+
 	// First depth
-	struct data_path data;
 #if LINUX_VERSION_CODE < KERNEL_VERSION(6, 8, 0)
-	strlcpy(data.dirpath, path, DATA_PATH_LEN);
+	strlcpy(data->dirpath, path, DATA_PATH_LEN);
 #else
-	strscpy(data.dirpath, path, DATA_PATH_LEN);
+	strscpy(data->dirpath, path, DATA_PATH_LEN);
 #endif
-	data.depth = depth;
-	list_add_tail(&data.list, &data_path_list);
-
-	for (i = depth; i >= 0; i--) {
-		struct data_path *pos, *n;
-
-		list_for_each_entry_safe(pos, n, &data_path_list, list) {
-			struct my_dir_context ctx = { .ctx.actor = my_actor,
-						      .data_path_list = &data_path_list,
-						      .parent_dir = pos->dirpath,
-						      .private_data = uid_data,
-						      .depth = pos->depth,
-						      .stop = &stop };
-			struct file *file;
-
-			if (!stop) {
-				file = ksu_filp_open_compat(pos->dirpath, O_RDONLY | O_NOFOLLOW | O_DIRECTORY, 0);
-				if (IS_ERR(file)) {
-					pr_err("Failed to open directory: %s, err: %ld\n", pos->dirpath, PTR_ERR(file));
-					goto skip_iterate;
-				}
-				
-				// grab magic on first folder, which is /data/app
-				if (!data_app_magic) {
-					if (S_MAGIC_COMPAT(file)) {
-						data_app_magic = S_MAGIC_COMPAT(file);
-						pr_info("%s: dir: %s got magic! 0x%lx\n", __func__, pos->dirpath, data_app_magic);
-					} else {
-						filp_close(file, NULL);
-						goto skip_iterate;
-					}
-				}
-				
-				if (S_MAGIC_COMPAT(file) != data_app_magic) {
-					pr_info("%s: skip: %s magic: 0x%lx expected: 0x%lx\n", __func__, pos->dirpath, 
-						S_MAGIC_COMPAT(file), data_app_magic);
-					filp_close(file, NULL);
-					goto skip_iterate;
-				}
+	data->depth = depth;
+	scan_queue_dir(scan, data);
 
-				iterate_dir(file, &ctx.ctx);
-				filp_close(file, NULL);
-			}
-skip_iterate:
-			list_del(&pos->list);
-			if (pos != &data)
-				kfree(pos);
-		}
+	while (!list_empty(&scan->serial)) {
+		data = list_first_entry(&scan->serial, struct data_path, list);
+		list_del(&data->list);
+		scan_dir(scan, data);
 	}
+	wait_for_completion(&scan->done);
+
+	*opened += scan->opened;
+	found = scan->manager[0];
+	if (found)
+		strcpy(manager, scan->manager);
+	kfree(scan);
+	return found;
+}
 
-	// Remove stale cached APK entries
-	list_for_each_entry_safe(pos, n, &apk_path_hash_list, list) {
-		if (!pos->exists) {
-			list_del(&pos->list);
-			kfree(pos);
-		}
+void search_manager(const char *path, int depth, struct uid_set *uid_data)
+{
+	char manager[DATA_PATH_LEN];
+	unsigned int opened = 0;
+	unsigned long start;
+	u32 fingerprint;
+	bool found = false;
+	int i;
+
+	// mark every cached verdict, the unseen ones are stale after a full search
+	struct apk_verdict *v;
+	if (!apk_verdicts_loaded)
+		apk_verdicts_load();
+
+	fingerprint = ksu_trusted_certs_fingerprint();
+	if (fingerprint != apk_verdicts_fingerprint) {
+		pr_info("%s: trusted certs changed, drop %u apk verdicts\n",
+			__func__, apk_verdict_count);
+		apk_verdicts_drop(false);
+		apk_verdicts_fingerprint = fingerprint;
+	}
+	for (i = 0; i < ARRAY_SIZE(apk_verdicts); i++) {
+		list_for_each_entry (v, &apk_verdicts[i], list)
+			v->seen = false;
+	}
+
+	if (manager_prefilter && load_manager_candidates()) {
+		start = jiffies;
+		found = walk_data_app(path, depth, &data_app_scan_ops, true,
+				      manager, &opened);
+		manager_scan_prefilter_ms = jiffies_to_msecs(jiffies - start);
+		manager_scan_prefilter_opened = opened;
+		pr_info("%s: candidates scan: %u apks in %ums, found: %d\n",
+			__func__, opened, manager_scan_prefilter_ms, found);
+		if (found)
+			goto crown;
 	}
+
+	opened = 0;
+	start = jiffies;
+	found = walk_data_app(path, depth, &data_app_scan_ops, false, manager,
+			      &opened);
+	manager_scan_full_ms = jiffies_to_msecs(jiffies - start);
+	manager_scan_full_opened = opened;
+	pr_info("%s: full scan: %u apks in %ums, found: %d\n", __func__, opened,
+		manager_scan_full_ms, found);
+
+	// the full search saw every apk, what it didn't see is gone
+	apk_verdicts_drop(true);
+crown:
+	if (found)
+		crown_manager(manager, uid_data);
+	apk_verdicts_save();
 }
 
 static bool is_uid_exist(uid_t uid, char *package, void *data)
 {
-	struct list_head *list = (struct list_head *)data;
-	struct uid_data *np;
+	struct uid_data *np = uid_set_find((struct uid_set *)data, package);
 
-	bool exist = false;
-	list_for_each_entry (np, list, list) {
-		if (np->uid == uid % 100000 &&
-		    strncmp(np->package, package, KSU_MAX_PACKAGE_NAME) == 0) {
-			exist = true;
-			break;
-		}
-	}
-	return exist;
+	return np && np->uid == uid % 100000;
 }
 
-static void track_throne_function()
+// enough for "<package> <uid>", the rest of a line is not needed
+#define PACKAGES_LINE_MAX (KSU_MAX_PACKAGE_NAME + 16)
+
+static void parse_packages_line(struct uid_set *set, char *line)
 {
-	struct file *fp;
-	int tries = 0;
+	char *tmp = line;
+	const char *delim = " ";
+	char *package = strsep(&tmp, delim);
+	char *uid = strsep(&tmp, delim);
+	u32 res;
+
+	if (!uid || !package || !*package) {
+		pr_err("update_uid: package or uid is NULL!\n");
+		return;
+	}
 
-	while (tries++ < 10) {
-		if (!is_lock_held(SYSTEM_PACKAGES_LIST_PATH)) {
-			fp = ksu_filp_open_compat(SYSTEM_PACKAGES_LIST_PATH, O_RDONLY, 0);
-			if (!IS_ERR(fp)) 
-				break;
-		}
-		
-		pr_info("%s: waiting for %s\n", __func__, SYSTEM_PACKAGES_LIST_PATH);
-		msleep(100); // migth as well add a delay
-	};
-	
-	if (IS_ERR(fp)) {
-		pr_err("%s: open " SYSTEM_PACKAGES_LIST_PATH " failed: %ld\n", __func__, PTR_ERR(fp));
+	if (kstrtou32(uid, 10, &res)) {
+		pr_err("update_uid: uid parse err\n");
 		return;
-	} else
-		pr_info("%s: %s found!\n", __func__, SYSTEM_PACKAGES_LIST_PATH);
+	}
 
-	struct list_head uid_list;
-	INIT_LIST_HEAD(&uid_list);
+	if (!uid_set_add(set, package, res))
+		pr_err("update_uid: alloc failed for %s\n", package);
+}
 
-	char chr = 0;
-	loff_t pos = 0;
-	loff_t line_start = 0;
-	char buf[KSU_MAX_PACKAGE_NAME];
-	for (;;) {
-		ssize_t count =
-			ksu_kernel_read_compat(fp, &chr, sizeof(chr), &pos);
-		if (count != sizeof(chr))
-			break;
-		if (chr != '\n')
-			continue;
+// a line may span reads, it is collected here until its '\n' shows up
+struct packages_parser {
+	struct uid_set *set;
+	size_t line_len;
+	char line[PACKAGES_LINE_MAX];
+};
 
-		count = ksu_kernel_read_compat(fp, buf, sizeof(buf),
-					       &line_start);
+static void parse_packages_chunk(struct packages_parser *parser,
+				 const char *p, size_t count)
+{
+	const char *end = p + count;
 
-		struct uid_data *data =
-			kzalloc(sizeof(struct uid_data), GFP_ATOMIC);
-		if (!data) {
-			filp_close(fp, 0);
-			goto out;
-		}
+	while (p < end) {
+		const char *nl = memchr(p, '\n', end - p);
+		size_t len = (nl ? nl : end) - p;
+		size_t room = PACKAGES_LINE_MAX - 1 - parser->line_len;
 
-		char *tmp = buf;
-		const char *delim = " ";
-		char *package = strsep(&tmp, delim);
-		char *uid = strsep(&tmp, delim);
-		if (!uid || !package) {
-			pr_err("update_uid: package or uid is NULL!\n");
-			break;
-		}
+		len = min(len, room);
+		memcpy(parser->line + parser->line_len, p, len);
+		parser->line_len += len;
 
-		u32 res;
-		if (kstrtou32(uid, 10, &res)) {
-			pr_err("update_uid: uid parse err\n");
+		if (!nl)
 			break;
-		}
-		data->uid = res;
-		strncpy(data->package, package, KSU_MAX_PACKAGE_NAME);
-		list_add_tail(&data->list, &uid_list);
-		// reset line start
-		line_start = pos;
+
+		parser->line[parser->line_len] = '\0';
+		parse_packages_line(parser->set, parser->line);
+		parser->line_len = 0;
+		p = nl + 1;
 	}
-	filp_close(fp, 0);
+}
 
-	// now update uid list
+/*
+ * read the file a page at a time and split lines in memory, a trailing
+ * line without '\n' is still being written and is ignored.
+ */
+static int parse_packages_list(struct file *fp, struct uid_set *set)
+{
+	struct packages_parser parser = { .set = set };
+	loff_t pos = 0;
+	ssize_t count;
+	char *chunk;
+
+	chunk = kmalloc(PAGE_SIZE, GFP_KERNEL);
+	if (!chunk)
+		return -ENOMEM;
+
+	while ((count = ksu_kernel_read_compat(fp, chunk, PAGE_SIZE, &pos)) > 0)
+		parse_packages_chunk(&parser, chunk, count);
+
+	kfree(chunk);
+	return count < 0 ? count : 0;
+}
+
+static void update_manager_and_prune(struct uid_set *uid_set, bool prune)
+{
 	struct uid_data *np;
-	struct uid_data *n;
 
 	// first, check if manager_uid exist!
 	bool manager_exist = false;
-	list_for_each_entry (np, &uid_list, list) {
+	list_for_each_entry (np, &uid_set->all, list) {
 		// if manager is installed in work profile, the uid in packages.list is still equals main profile
 		// don't delete it in this case!
 		int manager_uid = ksu_get_manager_uid() % 100000;
@@ -457,57 +1059,365 @@ static void track_throne_function()
 			goto prune;
 		}
 		pr_info("Searching manager...\n");
-		search_manager("/data/app", 2, &uid_list);
+		search_manager("/data/app", 2, uid_set);
 		pr_info("Search manager finished\n");
 	}
 
 prune:
 	// then prune the allowlist
-	ksu_prune_allowlist(is_uid_exist, &uid_list);
+	if (prune)
+		ksu_prune_allowlist(is_uid_exist, uid_set);
+}
+
+/*
+ * packages pushed by ksud through CMD_PUSH_PACKAGES, used instead of
+ * packages.list as long as the pushing process is alive.
+ */
+static DEFINE_MUTEX(throne_mutex);
+static struct uid_set *pushed_packages = NULL;
+static struct pid *packages_pusher = NULL;
+
+static void drop_pushed_packages_locked()
+{
+	if (pushed_packages) {
+		uid_set_destroy(pushed_packages);
+		kfree(pushed_packages);
+		pushed_packages = NULL;
+	}
+	if (packages_pusher) {
+		put_pid(packages_pusher);
+		packages_pusher = NULL;
+	}
+}
+
+// must hold throne_mutex
+static bool packages_pushed_locked()
+{
+	bool alive;
+
+	if (!packages_pusher)
+		return false;
+
+	rcu_read_lock();
+	alive = pid_task(packages_pusher, PIDTYPE_PID) != NULL;
+	rcu_read_unlock();
+
+	if (!alive) {
+		pr_info("package pusher is gone, parse packages.list again\n");
+		drop_pushed_packages_locked();
+	}
+	return alive;
+}
+
+static void track_throne_function(bool wait_rename)
+{
+	struct file *fp = ERR_PTR(-ENOENT);
+	unsigned int delay_us = 0, waited_us = 0;
+
+	mutex_lock(&throne_mutex);
+	if (packages_pushed_locked()) {
+		pr_info("%s: packages are pushed by ksud, skip\n", __func__);
+		goto unlock;
+	}
+
+	for (;;) {
+		if (packages_list_settled(wait_rename)) {
+			fp = ksu_filp_open_compat(SYSTEM_PACKAGES_LIST_PATH, O_RDONLY, 0);
+			if (!IS_ERR(fp)) 
+				break;
+		}
+
+		if (!ksu_wait_backoff(&delay_us, &waited_us)) {
+			// the rename may have failed, take whatever is there
+			pr_info("%s: timeout waiting for %s\n", __func__, SYSTEM_PACKAGES_LIST_PATH);
+			fp = ksu_filp_open_compat(SYSTEM_PACKAGES_LIST_PATH, O_RDONLY, 0);
+			break;
+		}
+	};
+	throne_wait_ms = waited_us / 1000;
+	
+	if (IS_ERR(fp)) {
+		pr_err("%s: open " SYSTEM_PACKAGES_LIST_PATH " failed: %ld\n", __func__, PTR_ERR(fp));
+		goto unlock;
+	} else
+		pr_info("%s: %s found!\n", __func__, SYSTEM_PACKAGES_LIST_PATH);
+
+	// 4K of buckets, too much for the stack
+	struct uid_set *uid_set = kmalloc(sizeof(*uid_set), GFP_KERNEL);
+	if (!uid_set) {
+		filp_close(fp, 0);
+		goto unlock;
+	}
+	uid_set_init(uid_set);
+
+	int err = parse_packages_list(fp, uid_set);
+	filp_close(fp, 0);
+	if (err) {
+		pr_err("%s: read " SYSTEM_PACKAGES_LIST_PATH " failed: %d\n", __func__, err);
+		goto out;
+	}
+
+	update_manager_and_prune(uid_set, true);
 out:
-	// free uid_list
-	list_for_each_entry_safe (np, n, &uid_list, list) {
-		list_del(&np->list);
-		kfree(np);
+	uid_set_destroy(uid_set);
+	kfree(uid_set);
+unlock:
+	mutex_unlock(&throne_mutex);
+}
+
+static int apply_package_record(struct uid_set *set, u32 uid, u8 op,
+				const char *name, u8 len, bool *removed)
+{
+	char package[KSU_MAX_PACKAGE_NAME];
+	struct uid_data *np;
+
+	if (!len)
+		return -EINVAL;
+	memcpy(package, name, len);
+	package[len] = '\0';
+
+	np = uid_set_find(set, package);
+	switch (op) {
+	case KSU_PACKAGE_ADD:
+		if (np) {
+			// same package with a new uid is a reinstall
+			*removed |= np->uid != uid;
+			np->uid = uid;
+			return 0;
+		}
+		return uid_set_add(set, package, uid) ? 0 : -ENOMEM;
+	case KSU_PACKAGE_REMOVE:
+		if (np) {
+			list_del(&np->list);
+			list_del(&np->hash_list);
+			kmem_cache_free(uid_data_cachep, np);
+			uid_data_live--;
+			*removed = true;
+		}
+		return 0;
+	default:
+		return -EINVAL;
 	}
 }
 
-static int throne_tracker_thread(void *data)
+int ksu_throne_push_packages(const void __user *ubuf, size_t size)
 {
-	pr_info("%s: pid: %d started\n", __func__, current->pid);
-	track_throne_function();
-	throne_thread = NULL;
-	smp_mb();
-	pr_info("%s: pid: %d exit!\n", __func__, current->pid);
-	return 0;
+	struct ksu_packages_header header;
+	struct uid_set *set, *fresh = NULL;
+	bool removed = false;
+	const u8 *p, *end;
+	void *buf;
+	u32 i;
+	int ret = 0;
+
+	if (size < sizeof(header) || size > KSU_MAX_PACKAGES_PUSH)
+		return -EINVAL;
+
+	buf = vmalloc(size);
+	if (!buf)
+		return -ENOMEM;
+
+	if (copy_from_user(buf, ubuf, size)) {
+		ret = -EFAULT;
+		goto out_free;
+	}
+
+	memcpy(&header, buf, sizeof(header));
+	if (header.magic != KSU_PACKAGES_MAGIC) {
+		ret = -EINVAL;
+		goto out_free;
+	}
+
+	// an empty full list would prune every profile, never trust it
+	if ((header.flags & KSU_PACKAGES_FULL) && !header.count) {
+		pr_warn("ignore empty full packages push\n");
+		ret = -EINVAL;
+		goto out_free;
+	}
+
+	mutex_lock(&throne_mutex);
+	if (header.flags & KSU_PACKAGES_FULL) {
+		fresh = kmalloc(sizeof(*fresh), GFP_KERNEL);
+		if (!fresh) {
+			ret = -ENOMEM;
+			goto out_unlock;
+		}
+		uid_set_init(fresh);
+		set = fresh;
+	} else if (packages_pushed_locked()) {
+		set = pushed_packages;
+	} else {
+		// a delta against nothing, ksud has to start over
+		ret = -ESTALE;
+		goto out_unlock;
+	}
+
+	p = (const u8 *)buf + sizeof(header);
+	end = (const u8 *)buf + size;
+	for (i = 0; i < header.count; i++) {
+		u32 uid;
+		u8 op, len;
+
+		if (end - p < KSU_PACKAGE_RECORD_HEADER)
+			break;
+		memcpy(&uid, p, sizeof(uid));
+		op = p[4];
+		len = p[5];
+		p += KSU_PACKAGE_RECORD_HEADER;
+		if (end - p < len)
+			break;
+
+		ret = apply_package_record(set, uid, op, (const char *)p, len,
+					   &removed);
+		if (ret)
+			break;
+		p += len;
+	}
+
+	if (!ret && i != header.count)
+		ret = -EINVAL;
+
+	if (ret) {
+		/*
+		 * a delta may be half applied, forget everything so the next
+		 * push has to be a full one and packages.list is used meanwhile.
+		 */
+		pr_err("push packages failed at record %u: %d\n", i, ret);
+		if (fresh) {
+			uid_set_destroy(fresh);
+			kfree(fresh);
+		} else {
+			drop_pushed_packages_locked();
+		}
+		goto out_unlock;
+	}
+
+	if (fresh) {
+		drop_pushed_packages_locked();
+		pushed_packages = fresh;
+		packages_pusher = get_pid(task_tgid(current));
+		// a full list says nothing about what is gone, check everything
+		removed = true;
+	}
+
+	pr_info("pushed %u packages (%s)\n", header.count,
+		fresh ? "full" : "delta");
+	// only a removal or a reinstall can make a profile stale
+	update_manager_and_prune(pushed_packages, removed);
+
+out_unlock:
+	mutex_unlock(&throne_mutex);
+out_free:
+	vfree(buf);
+	return ret;
+}
+
+/*
+ * runs are scheduled on a delayed work: a rename (re)arms it throne_debounce_ms
+ * ahead, so a burst of renames is merged into one run, and a rename during a
+ * run queues exactly one more.
+ */
+static struct delayed_work throne_work;
+static atomic_t throne_requests = ATOMIC_INIT(0);
+
+static unsigned int throne_debounce_ms = 100;
+module_param_named(throne_debounce_ms, throne_debounce_ms, uint, 0644);
+
+static unsigned int throne_runs = 0;
+module_param_named(throne_runs, throne_runs, uint, 0444);
+static unsigned int throne_merged = 0;
+module_param_named(throne_merged, throne_merged, uint, 0444);
+static unsigned int throne_last_run_ms = 0;
+module_param_named(throne_last_run_ms, throne_last_run_ms, uint, 0444);
+static unsigned int throne_total_run_ms = 0;
+module_param_named(throne_total_run_ms, throne_total_run_ms, uint, 0444);
+
+static void do_track_throne(struct work_struct *work)
+{
+	int requests = atomic_xchg(&throne_requests, 0);
+	unsigned long start = jiffies;
+
+	if (requests > 1)
+		throne_merged += requests - 1;
+
+	track_throne_function(true);
+
+	throne_runs++;
+	throne_last_run_ms = jiffies_to_msecs(jiffies - start);
+	throne_total_run_ms += throne_last_run_ms;
 }
 
 void ksu_track_throne()
 {
 	static bool throne_tracker_first_run __read_mostly = true;
 	if (unlikely(throne_tracker_first_run)) {
-		track_throne_function();
+		// runs in the rename hook, the renamed list is left to the work
+		track_throne_function(false);
 		throne_tracker_first_run = false;
-		return;
 	}
 
-	smp_mb();
-	if (throne_thread != NULL) // single instance lock
-		return;
-
-	throne_thread = kthread_run(throne_tracker_thread, NULL, "throne_tracker");
-	if (IS_ERR(throne_thread)) {
-		throne_thread = NULL;
-		return;
-	}
+	atomic_inc(&throne_requests);
+	// long running, keep it off the ordered ksu workqueue
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 7, 0)
+	mod_delayed_work(system_unbound_wq, &throne_work,
+			 msecs_to_jiffies(throne_debounce_ms));
+#else
+	queue_delayed_work(system_unbound_wq, &throne_work,
+			   msecs_to_jiffies(throne_debounce_ms));
+#endif
 }
 
 void ksu_throne_tracker_init()
 {
-	// nothing to do
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(apk_verdicts); i++)
+		INIT_LIST_HEAD(&apk_verdicts[i]);
+
+	INIT_DELAYED_WORK(&throne_work, do_track_throne);
+
+	uid_data_cachep = kmem_cache_create("ksu_uid_data", sizeof(struct uid_data),
+					    0, 0, NULL);
+	data_path_cachep = kmem_cache_create("ksu_data_path",
+					     sizeof(struct data_path), 0, 0, NULL);
+	apk_verdict_cachep = kmem_cache_create("ksu_apk_verdict",
+					       sizeof(struct apk_verdict), 0, 0,
+					       NULL);
+	if (!uid_data_cachep || !data_path_cachep || !apk_verdict_cachep)
+		pr_err("%s: create caches failed\n", __func__);
+
+	// without it the search walks the directories one by one
+	if (manager_scan_workers > 1)
+		ksu_scan_wq = alloc_workqueue("ksu_manager_scan", WQ_UNBOUND,
+					      manager_scan_workers);
+	if (manager_scan_workers > 1 && !ksu_scan_wq)
+		pr_err("%s: alloc scan workqueue failed\n", __func__);
 }
 
 void ksu_throne_tracker_exit()
 {
-	// nothing to do
+	cancel_delayed_work_sync(&throne_work);
+
+	mutex_lock(&throne_mutex);
+	drop_pushed_packages_locked();
+	apk_verdicts_drop(false);
+	mutex_unlock(&throne_mutex);
+
+	if (ksu_scan_wq)
+		destroy_workqueue(ksu_scan_wq);
+	ksu_scan_wq = NULL;
+
+	if (uid_data_cachep)
+		kmem_cache_destroy(uid_data_cachep);
+	if (data_path_cachep)
+		kmem_cache_destroy(data_path_cachep);
+	if (apk_verdict_cachep)
+		kmem_cache_destroy(apk_verdict_cachep);
+	uid_data_cachep = NULL;
+	data_path_cachep = NULL;
+	apk_verdict_cachep = NULL;
 }
+
+#ifdef CONFIG_KSU_KUNIT_TEST
+#include "throne_tracker_test.c"
+#endif
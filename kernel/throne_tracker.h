@@ -1,12 +1,25 @@
 #ifndef __KSU_H_UID_OBSERVER
 #define __KSU_H_UID_OBSERVER
 
+#include <linux/types.h>
+
+struct dentry;
+
 void ksu_throne_tracker_init();
 
 void ksu_throne_tracker_exit();
 
 void ksu_track_throne();
 
+// CMD_PUSH_PACKAGES from ksud
+int ksu_throne_push_packages(const void __user *ubuf, size_t size);
+
 bool is_lock_held(const char *path);
 
+// packages.list is about to be replaced by renamed
+void ksu_throne_note_rename(struct dentry *renamed);
+
+// sleep a little longer each call, false once the wait budget is used up
+bool ksu_wait_backoff(unsigned int *delay_us, unsigned int *waited_us);
+
 #endif
@@ -0,0 +1,381 @@
+/*
+ * KUnit cases for throne_tracker.c, included at its end so the static helpers
+ * are reachable. the packages.list parser is fed in chunks of every size, the
+ * result must not depend on where a read happens to split a line.
+ */
+#include <kunit/test.h>
+#include <linux/ktime.h>
+
+static const char test_packages[] =
+	"com.test.a 10001 0 /data/user/0/com.test.a default:targetSdkVersion=33 3003 0 1\n"
+	"com.test.bb 10002 1 /data/user/0/com.test.bb default 1065,3003 0 2\n"
+	"\n"
+	"broken-line-without-uid\n"
+	"com.test.ccc 10003 0 /data/user/0/com.test.ccc platform:privapp none 0 3\n"
+	"com.test.partial 10004 0";
+
+static unsigned int test_uid_set_size(struct uid_set *set)
+{
+	struct uid_data *np;
+	unsigned int n = 0;
+
+	list_for_each_entry (np, &set->all, list)
+		n++;
+	return n;
+}
+
+static void test_expect_package(struct kunit *test, struct uid_set *set,
+				const char *package, u32 uid)
+{
+	struct uid_data *np = uid_set_find(set, package);
+
+	KUNIT_EXPECT_TRUE(test, np != NULL);
+	if (np)
+		KUNIT_EXPECT_EQ(test, np->uid, uid);
+}
+
+// the buckets are too big for the stack
+static struct uid_set *test_uid_set(struct kunit *test)
+{
+	struct uid_set *set = kunit_kzalloc(test, sizeof(*set), GFP_KERNEL);
+
+	KUNIT_ASSERT_TRUE(test, set != NULL);
+	uid_set_init(set);
+	return set;
+}
+
+static void test_parse_in_chunks(struct kunit *test, const char *buf,
+				 size_t size, size_t step, struct uid_set *set)
+{
+	struct packages_parser *parser;
+	size_t off;
+
+	parser = kunit_kzalloc(test, sizeof(*parser), GFP_KERNEL);
+	KUNIT_ASSERT_TRUE(test, parser != NULL);
+	parser->set = set;
+
+	for (off = 0; off < size; off += step)
+		parse_packages_chunk(parser, buf + off, min(step, size - off));
+}
+
+static void throne_test_split_lines(struct kunit *test)
+{
+	size_t size = sizeof(test_packages) - 1;
+	struct uid_set *set = test_uid_set(test);
+	size_t step;
+
+	KUNIT_ASSERT_TRUE(test, uid_data_cachep != NULL);
+
+	mutex_lock(&throne_mutex);
+	for (step = 1; step <= size; step++) {
+		uid_set_init(set);
+		test_parse_in_chunks(test, test_packages, size, step, set);
+
+		KUNIT_EXPECT_EQ(test, test_uid_set_size(set), 3U);
+		test_expect_package(test, set, "com.test.a", 10001);
+		test_expect_package(test, set, "com.test.bb", 10002);
+		test_expect_package(test, set, "com.test.ccc", 10003);
+		// still being written, it shows up on the next parse
+		KUNIT_EXPECT_TRUE(test,
+				  !uid_set_find(set, "com.test.partial"));
+
+		uid_set_destroy(set);
+	}
+	mutex_unlock(&throne_mutex);
+}
+
+// the same with PAGE_SIZE reads and a line across each page boundary
+static void throne_test_page_boundary(struct kunit *test)
+{
+	size_t size = 3 * PAGE_SIZE;
+	unsigned int lines = 0;
+	struct uid_set *set = test_uid_set(test);
+	size_t off = 0;
+	char *buf;
+	u32 uid;
+
+	KUNIT_ASSERT_TRUE(test, uid_data_cachep != NULL);
+
+	buf = kunit_kzalloc(test, size + 1, GFP_KERNEL);
+	KUNIT_ASSERT_TRUE(test, buf != NULL);
+
+	// lines of different lengths so the boundaries land mid-line
+	for (uid = 10000; off + 64 < size; uid++) {
+		off += scnprintf(buf + off, size + 1 - off,
+				 "com.test.page%u%.*s %u 0 /data\n", uid,
+				 (int)(uid % 13), "xxxxxxxxxxxxx", uid);
+		lines++;
+	}
+
+	mutex_lock(&throne_mutex);
+	test_parse_in_chunks(test, buf, off, PAGE_SIZE, set);
+
+	KUNIT_EXPECT_EQ(test, test_uid_set_size(set), lines);
+	for (uid = 10000; uid < 10000 + lines; uid++) {
+		char package[64];
+
+		scnprintf(package, sizeof(package), "com.test.page%u%.*s", uid,
+			  (int)(uid % 13), "xxxxxxxxxxxxx");
+		test_expect_package(test, set, package, uid);
+	}
+
+	uid_set_destroy(set);
+	mutex_unlock(&throne_mutex);
+}
+
+// a line longer than the buffer is cut, the lines after it still parse
+static void throne_test_long_line(struct kunit *test)
+{
+	size_t size = 2 * PACKAGES_LINE_MAX + 64;
+	struct uid_set *set = test_uid_set(test);
+	size_t off;
+	char *buf;
+
+	KUNIT_ASSERT_TRUE(test, uid_data_cachep != NULL);
+
+	buf = kunit_kzalloc(test, size, GFP_KERNEL);
+	KUNIT_ASSERT_TRUE(test, buf != NULL);
+
+	off = scnprintf(buf, size, "com.test.long 10005 ");
+	memset(buf + off, 'x', 2 * PACKAGES_LINE_MAX - off);
+	off = 2 * PACKAGES_LINE_MAX;
+	buf[off++] = '\n';
+	off += scnprintf(buf + off, size - off, "com.test.after 10006 0\n");
+
+	mutex_lock(&throne_mutex);
+	test_parse_in_chunks(test, buf, off, 100, set);
+
+	KUNIT_EXPECT_EQ(test, test_uid_set_size(set), 2U);
+	test_expect_package(test, set, "com.test.long", 10005);
+	test_expect_package(test, set, "com.test.after", 10006);
+
+	uid_set_destroy(set);
+	mutex_unlock(&throne_mutex);
+}
+
+static void throne_test_pkg_from_path(struct kunit *test)
+{
+	static const struct {
+		const char *path;
+		const char *pkg;
+	} cases[] = {
+		{ "/data/app/~~abc==/me.weishu.kernelsu-xyz==/base.apk",
+		  "me.weishu.kernelsu" },
+		{ "/data/app/me.weishu.kernelsu-1/base.apk", "me.weishu.kernelsu" },
+		// the first '-' after the directory ends the package
+		{ "/data/app/~~a==/com.x-y-z==/base.apk", "com.x" },
+		{ "/data/app/~~a==/com.nohyphen/base.apk", NULL },
+		{ "/data/app/~~a==/-xyz==/base.apk", NULL },
+		{ "/data/app/~~a-b==/pkg/base.apk", NULL },
+		{ "base.apk", NULL },
+		{ "/base.apk", NULL },
+		{ "", NULL },
+	};
+	char pkg[KSU_MAX_PACKAGE_NAME];
+	char *path;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(cases); i++) {
+		int ret = get_pkg_from_apk_path(pkg, cases[i].path);
+
+		KUNIT_EXPECT_EQ(test, ret, cases[i].pkg ? 0 : -1);
+		if (!ret && cases[i].pkg)
+			KUNIT_EXPECT_STREQ(test, pkg, cases[i].pkg);
+	}
+
+	// longer than a package name can be
+	path = kunit_kzalloc(test, KSU_MAX_PACKAGE_NAME + 32, GFP_KERNEL);
+	KUNIT_ASSERT_TRUE(test, path != NULL);
+	strcpy(path, "/data/app/~~a==/");
+	memset(path + strlen(path), 'p', KSU_MAX_PACKAGE_NAME);
+	strcat(path, "-x==/base.apk");
+	KUNIT_EXPECT_EQ(test, get_pkg_from_apk_path(pkg, path), -1);
+}
+
+static void throne_test_candidates(struct kunit *test)
+{
+	char saved[sizeof(manager_candidates)];
+
+	mutex_lock(&throne_mutex);
+	memcpy(saved, manager_candidates, sizeof(saved));
+
+	strscpy(manager_candidates, " com.a.manager ,me.weishu.kernelsu,,com.b",
+		sizeof(manager_candidates));
+	KUNIT_EXPECT_TRUE(test, load_manager_candidates());
+	KUNIT_EXPECT_TRUE(test, is_manager_candidate("com.a.manager"));
+	KUNIT_EXPECT_TRUE(test, is_manager_candidate("me.weishu.kernelsu"));
+	KUNIT_EXPECT_TRUE(test, is_manager_candidate("com.b"));
+	KUNIT_EXPECT_FALSE(test, is_manager_candidate("com.a"));
+	KUNIT_EXPECT_FALSE(test, is_manager_candidate("com.b.other"));
+	KUNIT_EXPECT_FALSE(test, is_manager_candidate(""));
+
+	// only the first MAX_MANAGER_CANDIDATES count
+	strscpy(manager_candidates, "c0,c1,c2,c3,c4,c5,c6,c7,c8,c9",
+		sizeof(manager_candidates));
+	KUNIT_EXPECT_TRUE(test, load_manager_candidates());
+	KUNIT_EXPECT_LE(test, candidate_count, MAX_MANAGER_CANDIDATES);
+	KUNIT_EXPECT_FALSE(test, is_manager_candidate("c9"));
+
+#ifndef KSU_MANAGER_PACKAGE
+	// nothing to prefilter with, the search goes straight to a full scan
+	manager_candidates[0] = '\0';
+	KUNIT_EXPECT_FALSE(test, load_manager_candidates());
+#endif
+
+	memcpy(manager_candidates, saved, sizeof(saved));
+	load_manager_candidates();
+	mutex_unlock(&throne_mutex);
+}
+
+/*
+ * a synthetic /data/app for walk_data_app: TREE_DIRS ~~dNN== directories with
+ * TREE_PKGS package directories each, listed in reverse so the serial order
+ * meets the largest manager path first. checking an apk sleeps like a read
+ * from slow storage.
+ */
+#define TREE_ROOT "/ksu_test_app"
+#define TREE_DIRS 32
+#define TREE_PKGS 2
+#define TREE_APKS (TREE_DIRS * TREE_PKGS)
+#define TREE_CHECK_US 1000
+#define TREE_RUNS 4
+
+static const char *const tree_managers[] = {
+	TREE_ROOT "/~~d30==/p30_1-x==/base.apk",
+	TREE_ROOT "/~~d07==/p07_1-x==/base.apk",
+	TREE_ROOT "/~~d21==/p21_0-x==/base.apk",
+};
+static bool tree_has_managers;
+
+static void tree_emit(struct my_dir_context *ctx, const char *name,
+		      unsigned int type)
+{
+	ctx->ctx.actor(&ctx->ctx, name, strlen(name), 0, 0, type);
+}
+
+static void tree_iterate(struct manager_scan *scan, struct data_path *pos,
+			 struct my_dir_context *ctx)
+{
+	char name[32];
+	int i, n;
+
+	switch (pos->depth) {
+	case 2:
+		tree_emit(ctx, ".", DT_DIR);
+		tree_emit(ctx, "..", DT_DIR);
+		tree_emit(ctx, "vmdl1234.tmp", DT_DIR); // staging, skipped
+		for (i = TREE_DIRS - 1; i >= 0; i--) {
+			snprintf(name, sizeof(name), "~~d%02d==", i);
+			tree_emit(ctx, name, DT_DIR);
+		}
+		break;
+	case 1:
+		if (sscanf(strrchr(pos->dirpath, '/'), "/~~d%d==", &n) != 1)
+			break;
+		for (i = TREE_PKGS - 1; i >= 0; i--) {
+			snprintf(name, sizeof(name), "p%02d_%d-x==", n, i);
+			tree_emit(ctx, name, DT_DIR);
+		}
+		break;
+	default:
+		tree_emit(ctx, "oat", DT_DIR);
+		tree_emit(ctx, "base.apk", DT_REG);
+		break;
+	}
+}
+
+static enum ksu_apk_check tree_check(char *path)
+{
+	int i;
+
+	usleep_range(TREE_CHECK_US, TREE_CHECK_US + 100);
+	for (i = 0; tree_has_managers && i < ARRAY_SIZE(tree_managers); i++) {
+		if (!strcmp(path, tree_managers[i]))
+			return KSU_APK_MANAGER;
+	}
+	return KSU_APK_NOT_MANAGER;
+}
+
+static const struct manager_scan_ops tree_scan_ops = {
+	.iterate = tree_iterate,
+	.check = tree_check,
+};
+
+static u64 tree_scan(struct kunit *test, bool prefilter, const char *expected,
+		     unsigned int expected_opened)
+{
+	char *manager = kunit_kzalloc(test, DATA_PATH_LEN, GFP_KERNEL);
+	unsigned int opened = 0;
+	u64 start;
+	bool found;
+
+	KUNIT_ASSERT_TRUE(test, manager != NULL);
+
+	start = ktime_get_ns();
+	found = walk_data_app(TREE_ROOT, 2, &tree_scan_ops, prefilter, manager,
+			      &opened);
+	start = ktime_get_ns() - start;
+
+	KUNIT_EXPECT_TRUE(test, found == (expected != NULL));
+	if (found && expected)
+		KUNIT_EXPECT_STREQ(test, manager, expected);
+	KUNIT_EXPECT_EQ(test, opened, expected_opened);
+	return start;
+}
+
+// same manager whatever the workers do, and what the parallel walk gains
+static void throne_test_scan_tree(struct kunit *test)
+{
+	const char *smallest = tree_managers[1];
+	struct workqueue_struct *wq;
+	char saved[sizeof(manager_candidates)];
+	u64 serial_ns, parallel_ns = 0;
+	int i;
+
+	KUNIT_ASSERT_TRUE(test, data_path_cachep != NULL);
+
+	mutex_lock(&throne_mutex);
+	tree_has_managers = true;
+
+	for (i = 0; i < TREE_RUNS; i++)
+		parallel_ns += tree_scan(test, false, smallest, TREE_APKS);
+
+	wq = ksu_scan_wq;
+	ksu_scan_wq = NULL;
+	serial_ns = tree_scan(test, false, smallest, TREE_APKS);
+	ksu_scan_wq = wq;
+
+	kunit_info(test, "%d apks: serial %llu us, %d workers %llu us\n",
+		   TREE_APKS, serial_ns / 1000,
+		   wq ? manager_scan_workers : 1,
+		   parallel_ns / TREE_RUNS / 1000);
+
+	// the prefilter only opens the candidates
+	memcpy(saved, manager_candidates, sizeof(saved));
+	strscpy(manager_candidates, "p21_0,p99_9", sizeof(manager_candidates));
+	KUNIT_EXPECT_TRUE(test, load_manager_candidates());
+	tree_scan(test, true, tree_managers[2], 1);
+	memcpy(manager_candidates, saved, sizeof(saved));
+	load_manager_candidates();
+
+	tree_has_managers = false;
+	tree_scan(test, false, NULL, TREE_APKS);
+	mutex_unlock(&throne_mutex);
+}
+
+static struct kunit_case throne_test_cases[] = {
+	KUNIT_CASE(throne_test_split_lines),
+	KUNIT_CASE(throne_test_page_boundary),
+	KUNIT_CASE(throne_test_long_line),
+	KUNIT_CASE(throne_test_pkg_from_path),
+	KUNIT_CASE(throne_test_candidates),
+	KUNIT_CASE(throne_test_scan_tree),
+	{}
+};
+
+static struct kunit_suite throne_test_suite = {
+	.name = "ksu_throne_tracker",
+	.test_cases = throne_test_cases,
+};
+
+kunit_test_suite(throne_test_suite);
@@ -4,6 +4,7 @@
 
 #include <android/log.h>
 #include <cstring>
+#include <vector>
 
 #include "ksu.h"
 
@@ -28,6 +29,43 @@ Java_me_weishu_kernelsu_Natives_getVersion(JNIEnv *env, jobject) {
 extern "C"
 JNIEXPORT jintArray JNICALL
 Java_me_weishu_kernelsu_Natives_getAllowList(JNIEnv *env, jobject) {
+    // page through the list, start over if it changes in between
+    for (int retry = 0; retry < 5; ++retry) {
+        std::vector<uint32_t> uids;
+        ksu_uid_page page = {};
+        uint32_t generation = 0;
+        bool consistent = true;
+
+        do {
+            uids.resize(page.cursor + 256);
+            page.capacity = uids.size() - page.cursor;
+            page.uids = reinterpret_cast<uintptr_t>(uids.data() + page.cursor);
+            uint32_t cursor = page.cursor;
+            if (!get_allow_list_page(&page, true)) {
+                break;
+            }
+            if (cursor != 0 && page.generation != generation) {
+                consistent = false;
+                break;
+            }
+            generation = page.generation;
+        } while (!page.done);
+
+        if (!page.done && consistent) {
+            // older kernel without paging
+            break;
+        }
+        if (!consistent) {
+            LOGD("getAllowList: list changed, retry");
+            continue;
+        }
+
+        LOGD("getAllowList: size: %d", page.cursor);
+        auto array = env->NewIntArray(page.cursor);
+        env->SetIntArrayRegion(array, 0, page.cursor, reinterpret_cast<jint *>(uids.data()));
+        return array;
+    }
+
     int uids[1024];
     int size = 0;
     bool result = get_allow_list(uids, &size);
@@ -52,7 +90,7 @@ Java_me_weishu_kernelsu_Natives_isLkmMode(JNIEnv *env, jclass clazz) {
     return is_lkm_mode();
 }
 
-static void fillIntArray(JNIEnv *env, jobject list, int *data, int count) {
+static void fillIntArray(JNIEnv *env, jobject list, const int *data, int count) {
     auto cls = env->GetObjectClass(list);
     auto add = env->GetMethodID(cls, "add", "(Ljava/lang/Object;)Z");
     auto integerCls = env->FindClass("java/lang/Integer");
@@ -109,26 +147,7 @@ static void fillArrayWithList(JNIEnv *env, jobject list, int *data, int count) {
     }
 }
 
-extern "C"
-JNIEXPORT jobject JNICALL
-Java_me_weishu_kernelsu_Natives_getAppProfile(JNIEnv *env, jobject, jstring pkg, jint uid) {
-    if (env->GetStringLength(pkg) > KSU_MAX_PACKAGE_NAME) {
-        return nullptr;
-    }
-
-    p_key_t key = {};
-    auto cpkg = env->GetStringUTFChars(pkg, nullptr);
-    strcpy(key, cpkg);
-    env->ReleaseStringUTFChars(pkg, cpkg);
-
-    app_profile profile = {};
-    profile.version = KSU_APP_PROFILE_VER;
-
-    strcpy(profile.key, key);
-    profile.current_uid = uid;
-
-    bool useDefaultProfile = !get_app_profile(key, &profile);
-
+static jobject profileToObject(JNIEnv *env, const app_profile &profile, bool found) {
     auto cls = env->FindClass("me/weishu/kernelsu/Natives$Profile");
     auto constructor = env->GetMethodID(cls, "<init>", "()V");
     auto obj = env->NewObject(cls, constructor);
@@ -152,10 +171,10 @@ Java_me_weishu_kernelsu_Natives_getAppProfile(JNIEnv *env, jobject, jstring pkg,
     env->SetObjectField(obj, keyField, env->NewStringUTF(profile.key));
     env->SetIntField(obj, currentUidField, profile.current_uid);
 
-    if (useDefaultProfile) {
+    if (!found) {
         // no profile found, so just use default profile:
         // don't allow root and use default profile!
-        LOGD("use default profile for: %s, %d", key, uid);
+        LOGD("use default profile for: %s, %d", profile.key, profile.current_uid);
 
         // allow_su = false
         // non root use default = true
@@ -205,9 +224,7 @@ Java_me_weishu_kernelsu_Natives_getAppProfile(JNIEnv *env, jobject, jstring pkg,
     return obj;
 }
 
-extern "C"
-JNIEXPORT jboolean JNICALL
-Java_me_weishu_kernelsu_Natives_setAppProfile(JNIEnv *env, jobject clazz, jobject profile) {
+static bool objectToProfile(JNIEnv *env, jobject profile, app_profile *out) {
     auto cls = env->FindClass("me/weishu/kernelsu/Natives$Profile");
 
     auto keyField = env->GetFieldID(cls, "name", "Ljava/lang/String;");
@@ -250,7 +267,8 @@ Java_me_weishu_kernelsu_Natives_setAppProfile(JNIEnv *env, jobject clazz, jobjec
     auto allowSu = env->GetBooleanField(profile, allowSuField);
     auto umountModules = env->GetBooleanField(profile, umountModulesField);
 
-    app_profile p = {};
+    app_profile &p = *out;
+    p = {};
     p.version = KSU_APP_PROFILE_VER;
 
     strcpy(p.key, p_key);
@@ -289,8 +307,91 @@ Java_me_weishu_kernelsu_Natives_setAppProfile(JNIEnv *env, jobject clazz, jobjec
         p.nrp_config.profile.umount_modules = umountModules;
     }
 
+    return true;
+}
+
+extern "C"
+JNIEXPORT jobject JNICALL
+Java_me_weishu_kernelsu_Natives_getAppProfile(JNIEnv *env, jobject, jstring pkg, jint uid) {
+    if (env->GetStringLength(pkg) > KSU_MAX_PACKAGE_NAME) {
+        return nullptr;
+    }
+
+    p_key_t key = {};
+    auto cpkg = env->GetStringUTFChars(pkg, nullptr);
+    strcpy(key, cpkg);
+    env->ReleaseStringUTFChars(pkg, cpkg);
+
+    app_profile profile = {};
+    profile.version = KSU_APP_PROFILE_VER;
+
+    strcpy(profile.key, key);
+    profile.current_uid = uid;
+
+    bool found = get_app_profile(key, &profile);
+    return profileToObject(env, profile, found);
+}
+
+extern "C"
+JNIEXPORT jboolean JNICALL
+Java_me_weishu_kernelsu_Natives_setAppProfile(JNIEnv *env, jobject clazz, jobject profile) {
+    app_profile p = {};
+    if (!objectToProfile(env, profile, &p)) {
+        return false;
+    }
     return set_app_profile(&p);
 }
+
+extern "C"
+JNIEXPORT jobjectArray JNICALL
+Java_me_weishu_kernelsu_Natives_getAppProfiles(JNIEnv *env, jobject, jobjectArray keys,
+                                                jintArray uids) {
+    auto count = env->GetArrayLength(keys);
+    if (count != env->GetArrayLength(uids) || count > KSU_MAX_PROFILE_BATCH) {
+        return nullptr;
+    }
+
+    std::vector<app_profile> profiles(count);
+    auto cuids = env->GetIntArrayElements(uids, nullptr);
+    for (int i = 0; i < count; ++i) {
+        auto pkg = (jstring) env->GetObjectArrayElement(keys, i);
+        if (env->GetStringLength(pkg) > KSU_MAX_PACKAGE_NAME) {
+            env->ReleaseIntArrayElements(uids, cuids, JNI_ABORT);
+            return nullptr;
+        }
+        auto cpkg = env->GetStringUTFChars(pkg, nullptr);
+        strcpy(profiles[i].key, cpkg);
+        env->ReleaseStringUTFChars(pkg, cpkg);
+        env->DeleteLocalRef(pkg);
+
+        profiles[i].version = KSU_APP_PROFILE_VER;
+        profiles[i].current_uid = cuids[i];
+    }
+    env->ReleaseIntArrayElements(uids, cuids, JNI_ABORT);
+
+    std::vector<bool> found(count);
+    if (get_app_profiles(profiles.data(), count)) {
+        for (int i = 0; i < count; ++i) {
+            found[i] = profiles[i].version != 0;
+        }
+    } else {
+        // older kernel, one by one
+        LOGD("getAppProfiles: batch not supported, fallback");
+        for (int i = 0; i < count; ++i) {
+            found[i] = get_app_profile(profiles[i].key, &profiles[i]);
+        }
+    }
+
+    auto cls = env->FindClass("me/weishu/kernelsu/Natives$Profile");
+    auto array = env->NewObjectArray(count, cls, nullptr);
+    for (int i = 0; i < count; ++i) {
+        auto obj = profileToObject(env, profiles[i], found[i]);
+        env->SetObjectArrayElement(array, i, obj);
+        env->DeleteLocalRef(obj);
+    }
+    return array;
+}
+
 extern "C"
 JNIEXPORT jboolean JNICALL
 Java_me_weishu_kernelsu_Natives_uidShouldUmount(JNIEnv *env, jobject thiz, jint uid) {
@@ -305,4 +406,9 @@ extern "C"
 JNIEXPORT jboolean JNICALL
 Java_me_weishu_kernelsu_Natives_setSuEnabled(JNIEnv *env, jobject thiz, jboolean enabled) {
     return set_su_enabled(enabled);
+}
+extern "C"
+JNIEXPORT jboolean JNICALL
+Java_me_weishu_kernelsu_Natives_syncAllowList(JNIEnv *env, jobject thiz) {
+    return sync_allowlist();
 }
\ No newline at end of file
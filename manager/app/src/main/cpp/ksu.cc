@@ -2,12 +2,15 @@
 // Created by weishu on 2022/12/9.
 //
 
+#include <sys/mman.h>
 #include <sys/prctl.h>
 #include <stdint.h>
 #include <string.h>
 #include <stdio.h>
 #include <unistd.h>
 
+#include <atomic>
+
 #include "ksu.h"
 
 #define KERNEL_SU_OPTION 0xDEADBEEF
@@ -30,6 +33,11 @@
 #define CMD_IS_SU_ENABLED 14
 #define CMD_ENABLE_SU 15
 
+#define CMD_SYNC_ALLOWLIST 17
+#define CMD_GET_APP_PROFILES 19
+#define CMD_GET_ALLOW_LIST_PAGED 20
+#define CMD_GET_GRANT_MAP_FD 21
+
 static bool ksuctl(int cmd, void* arg1, void* arg2) {
     int32_t result = 0;
     prctl(KERNEL_SU_OPTION, cmd, arg1, arg2, &result);
@@ -66,6 +74,10 @@ bool get_allow_list(int *uids, int *size) {
     return ksuctl(CMD_GET_SU_LIST, uids, size);
 }
 
+bool get_allow_list_page(ksu_uid_page *page, bool allow) {
+    return ksuctl(CMD_GET_ALLOW_LIST_PAGED, page, reinterpret_cast<void*>(allow));
+}
+
 bool is_safe_mode() {
     return ksuctl(CMD_CHECK_SAFEMODE, nullptr, nullptr);
 }
@@ -75,8 +87,97 @@ bool is_lkm_mode() {
     return is_lkm;
 }
 
+static const ksu_grant_map *map_grant_map() {
+    int fd = -1;
+    if (!ksuctl(CMD_GET_GRANT_MAP_FD, &fd, nullptr) || fd < 0) {
+        return nullptr;
+    }
+    void *addr = mmap(nullptr, sizeof(ksu_grant_map), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        return nullptr;
+    }
+    auto m = static_cast<const ksu_grant_map *>(addr);
+    if (m->magic != KSU_GRANT_MAP_MAGIC) {
+        munmap(addr, sizeof(ksu_grant_map));
+        return nullptr;
+    }
+    return m;
+}
+
+// only a successful mapping is kept, a failed one is retried on the next query
+static const ksu_grant_map *get_grant_map() {
+    static std::atomic<const ksu_grant_map *> cached{nullptr};
+    auto map = cached.load(std::memory_order_acquire);
+    if (map) {
+        return map;
+    }
+    map = map_grant_map();
+    if (!map) {
+        return nullptr;
+    }
+    const ksu_grant_map *expected = nullptr;
+    if (!cached.compare_exchange_strong(expected, map, std::memory_order_acq_rel)) {
+        // another thread mapped it first
+        munmap(const_cast<ksu_grant_map *>(map), sizeof(ksu_grant_map));
+        return expected;
+    }
+    return map;
+}
+
+static bool test_bit64(const uint64_t *words, uint32_t nr) {
+    return (words[nr / 64] >> (nr % 64)) & 1;
+}
+
+bool grant_map_query(int uid, bool *granted, bool *should_umount) {
+    auto map = get_grant_map();
+    uint32_t user = static_cast<uint32_t>(uid) / 100000;
+    uint32_t appid = static_cast<uint32_t>(uid) % 100000;
+
+    // uid 0 depends on the caller's domain, only the kernel knows
+    if (!map || uid <= 0 || user >= KSU_GRANT_MAP_USERS || appid >= KSU_GRANT_MAP_APPIDS) {
+        return false;
+    }
+
+    for (int retry = 0; retry < 16; ++retry) {
+        uint32_t seq = __atomic_load_n(&map->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            continue;
+        }
+
+        bool is_manager = map->manager_uid == static_cast<uint32_t>(uid);
+        uint8_t slot = map->user_slot[user];
+        bool g = false, explicit_umount = false, umount = false;
+        if (slot > 0 && slot <= KSU_GRANT_MAP_SLOTS) {
+            const auto &s = map->slots[slot - 1];
+            g = test_bit64(s.granted, appid);
+            explicit_umount = test_bit64(s.explicit_umount, appid);
+            umount = test_bit64(s.umount, appid);
+        } else if (map->incomplete) {
+            return false;
+        }
+        bool default_umount = map->default_umount;
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&map->seq, __ATOMIC_RELAXED) != seq) {
+            continue;
+        }
+
+        // system uids below shell can't be granted, except system itself
+        bool forbidden = appid < 2000 && appid != 1000 && user == 0;
+        *granted = is_manager || (g && !forbidden);
+        // the first profile of the uid decides, a granted one is explicit without umount
+        *should_umount = !is_manager && (explicit_umount ? umount : default_umount);
+        return true;
+    }
+    return false;
+}
+
 bool uid_should_umount(int uid) {
-    bool should;
+    bool granted, should;
+    if (grant_map_query(uid, &granted, &should)) {
+        return should;
+    }
     return ksuctl(CMD_IS_UID_SHOULD_UMOUNT, reinterpret_cast<void*>(uid), &should) && should;
 }
 
@@ -88,10 +189,18 @@ bool get_app_profile(p_key_t key, app_profile *profile) {
     return ksuctl(CMD_GET_APP_PROFILE, (void*) profile, nullptr);
 }
 
+bool get_app_profiles(app_profile *profiles, int count) {
+    return ksuctl(CMD_GET_APP_PROFILES, profiles, reinterpret_cast<void*>(count));
+}
+
 bool set_su_enabled(bool enabled) {
     return ksuctl(CMD_ENABLE_SU, (void*) enabled, nullptr);
 }
 
+bool sync_allowlist() {
+    return ksuctl(CMD_SYNC_ALLOWLIST, nullptr, nullptr);
+}
+
 bool is_su_enabled() {
     bool enabled = true;
     // if ksuctl failed, we assume su is enabled, and it cannot be disabled.
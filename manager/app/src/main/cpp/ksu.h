@@ -6,6 +6,7 @@
 #define KERNELSU_KSU_H
 
 #include <linux/capability.h>
+#include <stdint.h>
 
 bool become_manager(const char *);
 
@@ -13,6 +14,46 @@ int get_version();
 
 bool get_allow_list(int *uids, int *size);
 
+struct ksu_uid_page {
+    uint32_t cursor; // in: 0 for the first page, out: cursor of the next page
+    uint32_t capacity; // in: number of entries uids can hold
+    uint32_t count; // out: number of entries written
+    uint32_t generation; // out: changes whenever the list changes
+    uint32_t done; // out: 1 if this is the last page
+    uint32_t reserved;
+    uint64_t uids; // in: pointer to a uint32_t array
+};
+
+// false if the kernel doesn't support paging
+bool get_allow_list_page(ksu_uid_page *page, bool allow);
+
+#define KSU_GRANT_MAP_MAGIC 0x4b53474d // 'KSGM'
+#define KSU_GRANT_MAP_USERS 1024
+#define KSU_GRANT_MAP_SLOTS 16
+#define KSU_GRANT_MAP_APPIDS 20000
+#define KSU_GRANT_MAP_WORDS ((KSU_GRANT_MAP_APPIDS + 63) / 64)
+
+struct ksu_grant_map_slot {
+    uint64_t granted[KSU_GRANT_MAP_WORDS];
+    uint64_t explicit_umount[KSU_GRANT_MAP_WORDS];
+    uint64_t umount[KSU_GRANT_MAP_WORDS];
+};
+
+// read only view of the kernel's per-uid decisions, see CMD_GET_GRANT_MAP_FD
+struct ksu_grant_map {
+    uint32_t magic;
+    uint32_t seq;
+    uint32_t manager_uid;
+    uint32_t default_umount;
+    uint32_t incomplete;
+    uint32_t reserved;
+    uint8_t user_slot[KSU_GRANT_MAP_USERS];
+    ksu_grant_map_slot slots[KSU_GRANT_MAP_SLOTS];
+};
+
+// answer from the shared grant map, false if the caller has to ask the kernel
+bool grant_map_query(int uid, bool *granted, bool *should_umount);
+
 bool uid_should_umount(int uid);
 
 bool is_safe_mode();
@@ -79,8 +120,17 @@ bool set_app_profile(const app_profile *profile);
 
 bool get_app_profile(p_key_t key, app_profile *profile);
 
+// one syscall for many profiles, entries which are not found get version 0.
+// false if the kernel doesn't support it.
+#define KSU_MAX_PROFILE_BATCH 4096
+
+bool get_app_profiles(app_profile *profiles, int count);
+
 bool set_su_enabled(bool enabled);
 
 bool is_su_enabled();
 
+// write pending allowlist changes now instead of after the kernel's debounce
+bool sync_allowlist();
+
 #endif //KERNELSU_KSU_H
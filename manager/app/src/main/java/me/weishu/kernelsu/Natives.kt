@@ -58,6 +58,27 @@ object Natives {
     external fun getAppProfile(key: String?, uid: Int): Profile
     external fun setAppProfile(profile: Profile?): Boolean
 
+    /**
+     * Get the profiles of many packages with a single kernel call.
+     * @param keys usually the package names
+     * @param uids the uid of each key
+     * @return the profiles in the same order, null if failed.
+     */
+    private external fun getAppProfiles(keys: Array<String>, uids: IntArray): Array<Profile>?
+
+    // the kernel takes at most this many profiles per call
+    private const val MAX_PROFILE_BATCH = 4096
+
+    fun getAppProfiles(keys: List<String>, uids: List<Int>): List<Profile> {
+        return keys.indices.chunked(MAX_PROFILE_BATCH).flatMap { chunk ->
+            val batch = getAppProfiles(
+                chunk.map { keys[it] }.toTypedArray(),
+                chunk.map { uids[it] }.toIntArray()
+            )
+            batch?.toList() ?: chunk.map { getAppProfile(keys[it], uids[it]) }
+        }
+    }
+
     /**
      * `su` compat mode can be disabled temporarily.
      *  0: disabled
@@ -67,6 +88,12 @@ object Natives {
     external fun isSuEnabled(): Boolean
     external fun setSuEnabled(enabled: Boolean): Boolean
 
+    /**
+     * The kernel delays allowlist writes a little to merge bursts,
+     * flush them now, e.g. before a reboot.
+     */
+    external fun syncAllowList(): Boolean
+
     private const val NON_ROOT_DEFAULT_PROFILE_KEY = "$"
     private const val NOBODY_UID = 9999
 
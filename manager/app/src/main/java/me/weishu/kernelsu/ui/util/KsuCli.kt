@@ -318,6 +318,8 @@ fun installBoot(
 }
 
 fun reboot(reason: String = "") {
+    // don't lose profile changes still waiting for the debounced write
+    Natives.syncAllowList()
     val shell = getRootShell()
     if (reason == "recovery") {
         // KEYCODE_POWER = 26, hide incorrect "Factory data reset" message
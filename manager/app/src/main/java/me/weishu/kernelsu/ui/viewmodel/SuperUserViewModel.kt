@@ -171,14 +171,18 @@ class SuperUserViewModel : ViewModel() {
 
             val packages = allPackages.list
 
-            apps = packages.map {
+            // one kernel call for all the profiles
+            val profiles = Natives.getAppProfiles(
+                packages.map { it.packageName },
+                packages.map { it.applicationInfo!!.uid }
+            )
+
+            apps = packages.mapIndexed { index, it ->
                 val appInfo = it.applicationInfo
-                val uid = appInfo!!.uid
-                val profile = Natives.getAppProfile(it.packageName, uid)
                 AppInfo(
-                    label = appInfo.loadLabel(pm).toString(),
+                    label = appInfo!!.loadLabel(pm).toString(),
                     packageInfo = it,
-                    profile = profile,
+                    profile = profiles[index],
                 )
             }.filter { it.packageName != ksuApp.packageName }
 
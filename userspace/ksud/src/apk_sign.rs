@@ -9,41 +9,18 @@ pub fn get_apk_signature(apk: &str) -> Result<(u32, String)> {
 
     let mut f = std::fs::File::open(apk)?;
 
-    let mut i = 0;
-    loop {
-        let mut n = [0u8; 2];
-        f.seek(SeekFrom::End(-i - 2))?;
-        f.read_exact(&mut n)?;
-
-        let n = u16::from_le_bytes(n);
-        if i64::from(n) == i {
-            f.seek(SeekFrom::Current(-22))?;
-            f.read_exact(&mut size4)?;
-
-            if u32::from_le_bytes(size4) ^ 0xcafe_babe_u32 == 0xccfb_f1ee_u32 {
-                if i > 0 {
-                    println!("warning: comment length is {i}");
-                }
-                break;
-            }
-        }
-
-        ensure!(n != 0xffff, "not a zip file");
-
-        i += 1;
+    let (comment_len, cd_offset) = find_eocd(&mut f)?;
+    if comment_len > 0 {
+        println!("warning: comment length is {comment_len}");
     }
-
-    f.seek(SeekFrom::Current(12))?;
-    // offset
-    f.read_exact(&mut size4)?;
-    f.seek(SeekFrom::Start(u64::from(u32::from_le_bytes(size4)) - 0x18))?;
+    f.seek(SeekFrom::Start(u64::from(cd_offset) - 0x18))?;
 
     f.read_exact(&mut size8)?;
     f.read_exact(&mut buffer)?;
 
     ensure!(&buffer == b"APK Sig Block 42", "Can not found sig block");
 
-    let pos = u64::from(u32::from_le_bytes(size4)) - (u64::from_le_bytes(size8) + 0x8);
+    let pos = u64::from(cd_offset) - (u64::from_le_bytes(size8) + 0x8);
     f.seek(SeekFrom::Start(pos))?;
     f.read_exact(&mut size_of_block)?;
 
@@ -87,6 +64,33 @@ pub fn get_apk_signature(apk: &str) -> Result<(u32, String)> {
     v2_signing.ok_or(anyhow::anyhow!("No signature found!"))
 }
 
+const EOCD_SIZE: usize = 22;
+const EOCD_MAX_COMMENT: usize = 0xffff;
+
+/// Read the last 64K + 22 bytes once and scan them backwards for the EOCD
+/// whose comment length matches, same as `find_eocd` in the kernel.
+/// Returns the comment length and the central directory offset.
+fn find_eocd<R: Read + Seek>(f: &mut R) -> Result<(usize, u32)> {
+    let size = f.seek(SeekFrom::End(0))?;
+    ensure!(size >= EOCD_SIZE as u64, "not a zip file");
+
+    let tail_len = size.min((EOCD_SIZE + EOCD_MAX_COMMENT) as u64);
+    let mut tail = vec![0u8; tail_len as usize];
+    f.seek(SeekFrom::Start(size - tail_len))?;
+    f.read_exact(&mut tail)?;
+
+    for i in 0..=(tail.len() - EOCD_SIZE) {
+        let p = &tail[tail.len() - EOCD_SIZE - i..];
+        let comment_len = u16::from_le_bytes([p[20], p[21]]);
+        if p[..4] == *b"PK\x05\x06" && usize::from(comment_len) == i {
+            let cd_offset = u32::from_le_bytes([p[16], p[17], p[18], p[19]]);
+            return Ok((i, cd_offset));
+        }
+    }
+
+    anyhow::bail!("not a zip file")
+}
+
 fn calc_cert_sha256(
     f: &mut std::fs::File,
     size4: &mut [u8; 4],
@@ -113,3 +117,65 @@ fn calc_cert_sha256(
 
     Ok((cert_len, sha256::digest(&cert)))
 }
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::io::Cursor;
+
+    // the same fixtures are checked against the kernel in apk_sign_test.c
+    fn eocd(cd_offset: u32, comment_len: u16) -> Vec<u8> {
+        let mut record = b"PK\x05\x06".to_vec();
+        record.resize(16, 0);
+        record.extend_from_slice(&cd_offset.to_le_bytes());
+        record.extend_from_slice(&comment_len.to_le_bytes());
+        record
+    }
+
+    fn zip(prefix: usize, cd_offset: u32, comment: &[u8]) -> Cursor<Vec<u8>> {
+        let mut data = vec![0u8; prefix];
+        data.extend(eocd(cd_offset, u16::try_from(comment.len()).unwrap()));
+        data.extend_from_slice(comment);
+        Cursor::new(data)
+    }
+
+    #[test]
+    fn eocd_without_comment() {
+        assert_eq!(find_eocd(&mut zip(0, 0, &[])).unwrap(), (0, 0));
+        assert_eq!(find_eocd(&mut zip(100, 0x40, &[])).unwrap(), (0, 0x40));
+    }
+
+    #[test]
+    fn eocd_missing() {
+        assert!(find_eocd(&mut Cursor::new(vec![0u8; 100])).is_err());
+    }
+
+    #[test]
+    fn eocd_short_file() {
+        let mut data = eocd(0, 0);
+        data.pop();
+        assert!(find_eocd(&mut Cursor::new(data)).is_err());
+        assert!(find_eocd(&mut Cursor::new(Vec::new())).is_err());
+    }
+
+    #[test]
+    fn eocd_max_comment() {
+        let comment = vec![b'c'; EOCD_MAX_COMMENT];
+        assert_eq!(
+            find_eocd(&mut zip(100, 0x1234, &comment)).unwrap(),
+            (EOCD_MAX_COMMENT, 0x1234)
+        );
+    }
+
+    #[test]
+    fn eocd_fake_in_comment() {
+        // a record in the comment whose length doesn't reach the end is skipped
+        let mut comment = b"xx".to_vec();
+        comment.extend(eocd(0x666, 3));
+        comment.extend_from_slice(b"yyyyyyyy");
+        assert_eq!(
+            find_eocd(&mut zip(100, 0x40, &comment)).unwrap(),
+            (comment.len(), 0x40)
+        );
+    }
+}
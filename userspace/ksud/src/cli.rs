@@ -38,6 +38,10 @@ enum Commands {
     /// Trigger `boot-complete` event
     BootCompleted,
 
+    /// Push package changes to the kernel, started on `service`
+    #[command(hide = true)]
+    PackageWatcher,
+
     /// Install KernelSU userspace component to system
     Install {
         #[arg(long, default_value = None)]
@@ -300,6 +304,7 @@ pub fn run() -> Result<()> {
     let result = match cli.command {
         Commands::PostFsData => init_event::on_post_data_fs(),
         Commands::BootCompleted => init_event::on_boot_completed(),
+        Commands::PackageWatcher => crate::package_watcher::run(),
 
         Commands::Module { command } => {
             #[cfg(any(target_os = "linux", target_os = "android"))]
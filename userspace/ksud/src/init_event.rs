@@ -125,6 +125,7 @@ fn run_stage(stage: &str, block: bool) {
 
 pub fn on_services() -> Result<()> {
     info!("on_services triggered!");
+    start_package_watcher();
     run_stage("service", false);
 
     Ok(())
@@ -139,6 +140,29 @@ pub fn on_boot_completed() -> Result<()> {
     Ok(())
 }
 
+#[cfg(unix)]
+fn start_package_watcher() {
+    use std::os::unix::process::CommandExt;
+
+    let result = unsafe {
+        std::process::Command::new(defs::DAEMON_PATH)
+            .arg("package-watcher")
+            .process_group(0)
+            .pre_exec(|| {
+                utils::switch_cgroups();
+                Ok(())
+            })
+            .spawn()
+    };
+
+    if let Err(e) = result {
+        warn!("Failed to start package watcher: {e:#}");
+    }
+}
+
+#[cfg(not(unix))]
+fn start_package_watcher() {}
+
 #[cfg(unix)]
 fn catch_bootlog(logname: &str, command: Vec<&str>) -> Result<()> {
     use std::os::unix::process::CommandExt;
@@ -41,3 +41,40 @@ pub fn report_boot_complete() {
 pub fn report_module_mounted() {
     report_event(EVENT_MODULE_MOUNTED);
 }
+
+const CMD_PUSH_PACKAGES: libc::c_ulong = 22;
+
+/// Same calling convention as the `rustix::process::ksu_*` helpers, for
+/// commands the rustix fork doesn't wrap yet: every prctl vararg is passed
+/// as a full `c_ulong` and the kernel acks by writing its option back.
+#[cfg(any(target_os = "linux", target_os = "android"))]
+fn ksuctl(cmd: libc::c_ulong, arg3: libc::c_ulong, arg4: libc::c_ulong) -> bool {
+    const KERNEL_SU_OPTION: u32 = 0xDEAD_BEEF;
+    let mut result: u32 = 0;
+    unsafe {
+        libc::prctl(
+            KERNEL_SU_OPTION as libc::c_int,
+            cmd,
+            arg3,
+            arg4,
+            &mut result as *mut u32 as libc::c_ulong,
+        );
+    }
+    result == KERNEL_SU_OPTION
+}
+
+/// Push a packages buffer (see `package_watcher`) to the kernel,
+/// false on kernels without `CMD_PUSH_PACKAGES` or a rejected buffer.
+#[cfg(any(target_os = "linux", target_os = "android"))]
+pub fn push_packages(buf: &[u8]) -> bool {
+    ksuctl(
+        CMD_PUSH_PACKAGES,
+        buf.as_ptr() as libc::c_ulong,
+        buf.len() as libc::c_ulong,
+    )
+}
+
+#[cfg(not(any(target_os = "linux", target_os = "android")))]
+pub fn push_packages(_buf: &[u8]) -> bool {
+    false
+}
@@ -9,6 +9,7 @@ mod ksucalls;
 #[cfg(target_os = "android")]
 mod magic_mount;
 mod module;
+mod package_watcher;
 mod profile;
 mod restorecon;
 mod sepolicy;
@@ -0,0 +1,152 @@
+//! Watch `/data/system/packages.list` and push the uid/package changes to the
+//! kernel, so that it does not need to reparse the file on every app install.
+
+use anyhow::{Result, bail};
+use log::{info, warn};
+use std::collections::HashMap;
+
+use crate::ksucalls;
+
+const PACKAGES_DIR: &str = "/data/system";
+const PACKAGES_LIST: &str = "/data/system/packages.list";
+const PACKAGES_LIST_NAME: &[u8] = b"packages.list";
+
+// keep in sync with kernel/ksu.h
+const KSU_PACKAGES_MAGIC: u32 = 0x4b53_504b;
+const KSU_PACKAGES_FULL: u32 = 1;
+const KSU_PACKAGE_ADD: u8 = 1;
+const KSU_PACKAGE_REMOVE: u8 = 2;
+const KSU_MAX_PACKAGE_NAME: usize = 255;
+
+type Packages = HashMap<String, u32>;
+
+fn read_packages() -> Result<Packages> {
+    let content = std::fs::read_to_string(PACKAGES_LIST)?;
+    let mut packages = Packages::new();
+    for line in content.lines() {
+        let mut fields = line.split(' ');
+        let (Some(package), Some(uid)) = (fields.next(), fields.next()) else {
+            continue;
+        };
+        if package.is_empty() || package.len() > KSU_MAX_PACKAGE_NAME {
+            continue;
+        }
+        if let Ok(uid) = uid.parse::<u32>() {
+            packages.insert(package.to_string(), uid);
+        }
+    }
+    Ok(packages)
+}
+
+fn encode<'a>(flags: u32, records: impl Iterator<Item = (u8, &'a str, u32)>) -> Vec<u8> {
+    let mut buf = Vec::new();
+    let mut count: u32 = 0;
+    buf.extend_from_slice(&KSU_PACKAGES_MAGIC.to_ne_bytes());
+    buf.extend_from_slice(&flags.to_ne_bytes());
+    buf.extend_from_slice(&count.to_ne_bytes());
+    buf.extend_from_slice(&0u32.to_ne_bytes());
+    for (op, package, uid) in records {
+        buf.extend_from_slice(&uid.to_ne_bytes());
+        buf.push(op);
+        buf.push(package.len() as u8);
+        buf.extend_from_slice(package.as_bytes());
+        count += 1;
+    }
+    buf[8..12].copy_from_slice(&count.to_ne_bytes());
+    buf
+}
+
+fn push_full(packages: &Packages) -> bool {
+    // the kernel refuses an empty full list, it would drop every profile
+    if packages.is_empty() {
+        return false;
+    }
+    let records = packages
+        .iter()
+        .map(|(package, uid)| (KSU_PACKAGE_ADD, package.as_str(), *uid));
+    ksucalls::push_packages(&encode(KSU_PACKAGES_FULL, records))
+}
+
+/// Push what changed between `old` and `new`, nothing if they are equal.
+fn push_delta(old: &Packages, new: &Packages) -> bool {
+    let removed = old
+        .keys()
+        .filter(|package| !new.contains_key(*package))
+        .map(|package| (KSU_PACKAGE_REMOVE, package.as_str(), 0));
+    let changed = new
+        .iter()
+        .filter(|(package, uid)| old.get(*package) != Some(*uid))
+        .map(|(package, uid)| (KSU_PACKAGE_ADD, package.as_str(), *uid));
+    let buf = encode(0, removed.chain(changed));
+    if buf[8..12] == [0; 4] {
+        return true;
+    }
+    ksucalls::push_packages(&buf)
+}
+
+#[cfg(any(target_os = "linux", target_os = "android"))]
+pub fn run() -> Result<()> {
+    use std::ffi::CString;
+
+    let fd = unsafe { libc::inotify_init1(libc::IN_CLOEXEC) };
+    if fd < 0 {
+        bail!("inotify_init1: {}", std::io::Error::last_os_error());
+    }
+    let dir = CString::new(PACKAGES_DIR)?;
+    // packages.list is always replaced by a rename of packages.list.tmp
+    if unsafe { libc::inotify_add_watch(fd, dir.as_ptr(), libc::IN_MOVED_TO) } < 0 {
+        bail!("inotify_add_watch: {}", std::io::Error::last_os_error());
+    }
+
+    let mut packages = read_packages()?;
+    if !push_full(&packages) {
+        info!("kernel does not accept pushed packages, exit");
+        return Ok(());
+    }
+    info!("pushed {} packages", packages.len());
+
+    let mut events = [0u8; 4096];
+    loop {
+        let len = unsafe { libc::read(fd, events.as_mut_ptr().cast(), events.len()) };
+        if len < 0 {
+            let err = std::io::Error::last_os_error();
+            if err.kind() == std::io::ErrorKind::Interrupted {
+                continue;
+            }
+            bail!("read inotify: {err}");
+        }
+
+        let mut updated = false;
+        let mut offset = 0usize;
+        let header = std::mem::size_of::<libc::inotify_event>();
+        while offset + header <= len as usize {
+            let event: libc::inotify_event =
+                unsafe { std::ptr::read_unaligned(events.as_ptr().add(offset).cast()) };
+            let name = &events[offset + header..offset + header + event.len as usize];
+            let name = name.split(|b| *b == 0).next().unwrap_or_default();
+            updated |= name == PACKAGES_LIST_NAME;
+            offset += header + event.len as usize;
+        }
+        if !updated {
+            continue;
+        }
+
+        let new = match read_packages() {
+            Ok(new) => new,
+            Err(e) => {
+                warn!("read {PACKAGES_LIST}: {e}");
+                continue;
+            }
+        };
+        // the kernel drops everything after a failed delta, start over
+        if !push_delta(&packages, &new) && !push_full(&new) {
+            bail!("push packages failed");
+        }
+        packages = new;
+    }
+}
+
+#[cfg(not(any(target_os = "linux", target_os = "android")))]
+pub fn run() -> Result<()> {
+    bail!("unsupported platform")
+}